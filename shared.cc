@@ -16,14 +16,39 @@
 #include <memory>
 using std::auto_ptr;
 
+#include <algorithm>
+using std::min;
+using std::max;
+
+#include <utility>
+using std::pair;
+using std::make_pair;
+
 // c headers
 #include <unistd.h>
 #include <stdarg.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
 
 
 /*
@@ -88,61 +113,1620 @@ tokenize(vector<string>& dst, const string& buf,
 
 
 
+/*
+ * Statistics
+ */
+
+struct stats_entry
+{
+  const char* name;
+  unsigned calls;
+  double wall;
+  double cpu;
+};
+
+
+static struct
+{
+  const char* tool;
+  bool enabled;
+  bool json;
+  double wall;
+  double cpu;
+  vector<stats_entry> phases;
+  uint64_t counters[stats_counters];
+} stats;
+
+// phases can end concurrently on worker threads
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static double
+clockSeconds(clockid_t id)
+{
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void
+statsPrint()
+{
+  double wall = clockSeconds(CLOCK_MONOTONIC) - stats.wall;
+  double cpu = clockSeconds(CLOCK_PROCESS_CPUTIME_ID) - stats.cpu;
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  const uint64_t* c = stats.counters;
+
+  if(stats.json)
+  {
+    string buf = sprintf2("{\"tool\": \"%s\", \"phases\": [", stats.tool);
+    foreach_ro(vector<stats_entry>, it, stats.phases)
+    {
+      buf += sprintf2("%s{\"name\": \"%s\", \"calls\": %u, \"wall\": %.6f, \"cpu\": %.6f}",
+	  (it == stats.phases.begin()? "": ", "), it->name, it->calls, it->wall, it->cpu);
+    }
+    buf += sprintf2("], \"wall\": %.6f, \"cpu\": %.6f, \"bytes_read\": %llu, "
+	"\"bytes_written\": %llu, \"rows\": %llu, \"cells\": %llu, \"peak_rss_kb\": %ld}",
+	wall, cpu, (unsigned long long)c[stats_bytes_read],
+	(unsigned long long)c[stats_bytes_written], (unsigned long long)c[stats_rows],
+	(unsigned long long)c[stats_cells], ru.ru_maxrss);
+    cerr << buf << std::endl;
+    return;
+  }
+
+  cerr << stats.tool << ": statistics:\n"
+       << sprintf2("  %-16s %6s %10s %10s\n", "phase", "calls", "wall (s)", "cpu (s)");
+  foreach_ro(vector<stats_entry>, it, stats.phases)
+    cerr << sprintf2("  %-16s %6u %10.3f %10.3f\n", it->name, it->calls, it->wall, it->cpu);
+  cerr << sprintf2("  %-16s %6s %10.3f %10.3f\n", "total", "", wall, cpu)
+       << sprintf2("  bytes read: %llu\n", (unsigned long long)c[stats_bytes_read])
+       << sprintf2("  bytes written: %llu\n", (unsigned long long)c[stats_bytes_written])
+       << sprintf2("  rows: %llu\n", (unsigned long long)c[stats_rows])
+       << sprintf2("  cells: %llu\n", (unsigned long long)c[stats_cells])
+       << sprintf2("  peak RSS: %ld KB\n", ru.ru_maxrss);
+}
+
+
+void
+statsInit(const char* tool, bool enable)
+{
+  const char* env = getenv("TBLSTATS");
+  if(!enable && !(env && *env && strcmp(env, "0"))) return;
+  if(stats.enabled) return;
+
+  stats.tool = tool;
+  stats.enabled = true;
+  stats.json = (env && !strcmp(env, "json"));
+  stats.wall = clockSeconds(CLOCK_MONOTONIC);
+  stats.cpu = clockSeconds(CLOCK_PROCESS_CPUTIME_ID);
+  atexit(statsPrint);
+}
+
+
+void
+statsCount(stats_counter c, uint64_t n)
+{
+  __sync_fetch_and_add(&stats.counters[c], n);
+}
+
+
+stats_phase::stats_phase(const char* name)
+: name(stats.enabled? name: NULL)
+{
+  if(!this->name) return;
+  wall = clockSeconds(CLOCK_MONOTONIC);
+  cpu = clockSeconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+
+void
+stats_phase::end()
+{
+  if(!name) return;
+  double wall = clockSeconds(CLOCK_MONOTONIC) - this->wall;
+  double cpu = clockSeconds(CLOCK_PROCESS_CPUTIME_ID) - this->cpu;
+
+  pthread_mutex_lock(&statsLock);
+  vector<stats_entry>::iterator it;
+  for(it = stats.phases.begin(); it != stats.phases.end(); ++it)
+    if(!strcmp(it->name, name)) break;
+  if(it == stats.phases.end())
+  {
+    stats_entry e = {name, 0, 0., 0.};
+    it = stats.phases.insert(it, e);
+  }
+
+  ++it->calls;
+  it->wall += wall;
+  it->cpu += cpu;
+  pthread_mutex_unlock(&statsLock);
+  name = NULL;
+}
+
+
+
+/*
+ * Threading helpers
+ */
+
+unsigned
+tblThreads()
+{
+  static unsigned threads = 0;
+  if(!threads)
+  {
+    const char* env = getenv("TBLTHREADS");
+    long n = (env && *env? strtol(env, NULL, 10): sysconf(_SC_NPROCESSORS_ONLN));
+    threads = (n > 0? n: 1);
+  }
+  return threads;
+}
+
+
+struct parallel_state
+{
+  parallel_job* job;
+  size_t n;
+  size_t next;
+  bool failed;
+  string error;
+  pthread_mutex_t lock;
+};
+
+
+static void*
+parallelWorker(void* arg)
+{
+  parallel_state& st = *static_cast<parallel_state*>(arg);
+  for(;;)
+  {
+    size_t i = __sync_fetch_and_add(&st.next, 1);
+    if(i >= st.n || st.failed) break;
+
+    try { (*st.job)(i); }
+    catch(const std::exception& e)
+    {
+      pthread_mutex_lock(&st.lock);
+      if(!st.failed)
+      {
+	st.failed = true;
+	st.error = e.what();
+      }
+      pthread_mutex_unlock(&st.lock);
+    }
+  }
+  return NULL;
+}
+
+
+void
+parallelRun(parallel_job& job, size_t n, unsigned threads)
+{
+  if(!threads) threads = tblThreads();
+  if(threads > n) threads = n;
+  if(threads <= 1)
+  {
+    for(size_t i = 0; i != n; ++i)
+      job(i);
+    return;
+  }
+
+  parallel_state st;
+  st.job = &job;
+  st.n = n;
+  st.next = 0;
+  st.failed = false;
+  pthread_mutex_init(&st.lock, NULL);
+
+  // the calling thread is the last worker
+  vector<pthread_t> tids;
+  for(unsigned t = 1; t != threads; ++t)
+  {
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, parallelWorker, &st)) break;
+    tids.push_back(tid);
+  }
+  parallelWorker(&st);
+  for(vector<pthread_t>::iterator it = tids.begin(); it != tids.end(); ++it)
+    pthread_join(*it, NULL);
+  pthread_mutex_destroy(&st.lock);
+
+  if(st.failed)
+    throw runtime_error(st.error);
+}
+
+
+
+/*
+ * Delimiter scanning
+ */
+
+static void
+delimScanScalar(const char* p, size_t n, const char sep,
+    uint64_t* sepMask, uint64_t* nlMask)
+{
+  uint64_t sm = 0, nm = 0;
+  for(size_t i = 0; i != n; ++i)
+  {
+    if(p[i] == '\n') nm |= (uint64_t)1 << i;
+    if(p[i] == sep) sm |= (uint64_t)1 << i;
+  }
+  *sepMask = sm;
+  *nlMask = nm;
+}
+
+
+#ifdef HAVE_X86_KERNELS
+
+#ifdef __SSE2__
+static void
+delimScanSSE2(const char* p, size_t n, const char sep,
+    uint64_t* sepMask, uint64_t* nlMask)
+{
+  if(n != 64) return delimScanScalar(p, n, sep, sepMask, nlMask);
+
+  const __m128i vs = _mm_set1_epi8(sep);
+  const __m128i vn = _mm_set1_epi8('\n');
+  uint64_t sm = 0, nm = 0;
+  for(int i = 0; i != 4; ++i)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + i * 16));
+    sm |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vs)) << (i * 16);
+    nm |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vn)) << (i * 16);
+  }
+  *sepMask = sm;
+  *nlMask = nm;
+}
+#endif
+
+
+__attribute__((target("avx2")))
+static void
+delimScanAVX2(const char* p, size_t n, const char sep,
+    uint64_t* sepMask, uint64_t* nlMask)
+{
+  if(n != 64) return delimScanScalar(p, n, sep, sepMask, nlMask);
+
+  const __m256i vs = _mm256_set1_epi8(sep);
+  const __m256i vn = _mm256_set1_epi8('\n');
+  __m256i lo = _mm256_loadu_si256((const __m256i*)p);
+  __m256i hi = _mm256_loadu_si256((const __m256i*)(p + 32));
+  *sepMask = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vs))
+      | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vs)) << 32;
+  *nlMask = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vn))
+      | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vn)) << 32;
+}
+
+
+__attribute__((target("avx512bw")))
+static void
+delimScanAVX512(const char* p, size_t n, const char sep,
+    uint64_t* sepMask, uint64_t* nlMask)
+{
+  if(n != 64) return delimScanScalar(p, n, sep, sepMask, nlMask);
+
+  __m512i v = _mm512_loadu_si512((const void*)p);
+  *sepMask = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(sep));
+  *nlMask = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\n'));
+}
+
+#endif
+
+
+struct delim_kernel
+{
+  const char* name;
+  delim_scan_fn fn;
+  bool supported;
+};
+
+
+// in order of preference
+static delim_kernel delimKernels[] =
+{
+#ifdef HAVE_X86_KERNELS
+  {"avx512", delimScanAVX512, false},
+  {"avx2", delimScanAVX2, false},
+#ifdef __SSE2__
+  {"sse2", delimScanSSE2, false},
+#endif
+#endif
+  {"scalar", delimScanScalar, true},
+};
+
+static const delim_kernel* delimBest = NULL;
+static pthread_once_t delimOnce = PTHREAD_ONCE_INIT;
+
+
+static void
+delimScanInit()
+{
+  delim_kernel* kernels = delimKernels;
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  kernels[0].supported = __builtin_cpu_supports("avx512bw");
+  kernels[1].supported = __builtin_cpu_supports("avx2");
+#ifdef __SSE2__
+  kernels[2].supported = true;
+#endif
+#endif
+
+  const char* env = getenv("TBLSIMD");
+  for(size_t i = 0; !delimBest && i != ARRAY_LENGTH(delimKernels); ++i)
+  {
+    if(kernels[i].supported && (!env || !strcmp(env, kernels[i].name)))
+      delimBest = &kernels[i];
+  }
+  if(!delimBest)
+  {
+    cerr << "warning: unsupported TBLSIMD kernel \"" << env << "\"\n";
+    for(size_t i = 0; !delimBest; ++i)
+      if(kernels[i].supported) delimBest = &kernels[i];
+  }
+}
+
+
+delim_scan_fn
+delimScanKernel(const char** name)
+{
+  // the parser threads can race for the first call
+  pthread_once(&delimOnce, delimScanInit);
+  if(name) *name = delimBest->name;
+  return delimBest->fn;
+}
+
+
+
 /*
  * I/O
  */
 
-fix_string_matrix*
-mapFixStringMatrix(const char** addr, const char* file, const char sep, int* fd)
+// Report a warning about 'file': appended to 'log' when given (to be reported
+// along with the other messages about the file), or written out right away.
+static void
+fileWarning(string* log, const char* file, const char* msg)
 {
-  // open the file
-  *addr = NULL;
-  int _fd = open(file, O_RDONLY);
-  if(fd) *fd = _fd;
-  if(_fd < 0)
-    throw runtime_error(sprintf2("%s: error: cannot open file!", file));
+  string buf = sprintf2("%s: warning: %s\n", file, msg);
+  if(log) *log += buf;
+  else cerr << buf;
+}
 
-  // map the file
-  struct stat stBuf;
-  fstat(_fd, &stBuf);
-  size_t addrLen = stBuf.st_size;
-  *addr = (const char*)mmap(NULL, addrLen, PROT_READ, MAP_SHARED, _fd, 0);
-  if(!fd) close(_fd);
-  if(!*addr)
-    throw runtime_error(sprintf2("%s: error: cannot map file!", file));
 
-  // start reading
-  auto_ptr<fix_string_matrix> m(new fix_string_matrix);
-  vector<fix_string> row;
-  const char* s = *addr;
-  const char* p;
-  for(p = s; p != (*addr + addrLen); ++p)
+// minimum amount of data worth handing to a separate parser thread
+static const size_t parseChunkMin = 1 << 22;
+
+
+template<class T>
+struct parse_chunk
+{
+  const char* begin;
+  const char* end;
+  vector<T> offsets;	// cell start offsets, relative to the table base
+  size_t rows;
+  size_t cols;		// width of the first row
+  bool ragged;		// a row differs in width from the first one
+  bool partial;		// the last row is missing the final newline
+};
+
+
+template<class T>
+static void
+parseChunk(parse_chunk<T>& c, const char* base, const char sep)
+{
+  delim_scan_fn scan = delimScanKernel();
+  size_t cells = 1;
+  c.offsets.push_back(c.begin - base);
+
+  // walk the separator/newline bitmasks of each 64-byte block
+  for(const char* b = c.begin; b < c.end; b += 64)
   {
-    if(*p == '\n')
+    size_t n = c.end - b;
+    if(n > 64) n = 64;
+
+    uint64_t sepMask, nlMask;
+    scan(b, n, sep, &sepMask, &nlMask);
+
+    for(uint64_t mask = sepMask | nlMask; mask; mask &= mask - 1)
     {
-      size_t len = p - s;
-      if(*(p - 1) == '\r') --len;
-      row.push_back(fix_string(s, len));
-      s = p + 1;
-      m->push_back(row);
-      row.clear();
-
-      if(m->front().size() != m->back().size())
-	throw runtime_error(sprintf2("%s: error: variable number of columns", file));
+      const unsigned i = __builtin_ctzll(mask);
+      const T next = b + i + 1 - base;
+      if((nlMask >> i) & 1)
+      {
+	if(!c.rows++) c.cols = cells;
+	else if(cells != c.cols)
+	{
+	  c.ragged = true;
+	  return;
+	}
+	cells = 0;
+      }
+      c.offsets.push_back(next);
+      ++cells;
     }
-    else if(*p == sep)
+  }
+
+  if(c.end[-1] == '\n')
+  {
+    // the start of the next row doubles as the end of this one
+    c.offsets.pop_back();
+  }
+  else
+  {
+    // remaining data without newline
+    if(!c.rows++) c.cols = cells;
+    else if(cells != c.cols) c.ragged = true;
+    c.partial = true;
+  }
+}
+
+
+// lazy parsing of the leading columns only (see parseFixProjection)
+struct parse_proj
+{
+  size_t width;		// cells split at the start of each row
+  size_t cols;		// expected width of the table
+  bool check;		// count the separators of the rest of the row
+};
+
+
+// Like parseChunk, but splitting only the first 'width' cells of each row.
+// The rest of the row is kept as a single cell, whose separators are either
+// just counted (with 'check') or skipped altogether up to the next newline.
+template<class T>
+static void
+projectChunk(parse_chunk<T>& c, const char* base, const char sep,
+    const parse_proj& p)
+{
+  delim_scan_fn scan = delimScanKernel();
+  const size_t expected = (p.check? p.cols: p.width + 1);
+  size_t cells = 1;
+  c.cols = p.width + 1;
+  c.offsets.push_back(c.begin - base);
+
+  for(const char* b = c.begin; b < c.end;)
+  {
+    size_t n = c.end - b;
+    if(n > 64) n = 64;
+
+    uint64_t sepMask, nlMask;
+    scan(b, n, sep, &sepMask, &nlMask);
+
+    const char* next = b + n;
+    uint64_t mask = sepMask | nlMask;
+    while(mask)
     {
-      row.push_back(fix_string(s, p - s));
-      s = p + 1;
+      const unsigned i = __builtin_ctzll(mask);
+      if((nlMask >> i) & 1)
+      {
+	++c.rows;
+	if(cells != expected)
+	{
+	  c.ragged = true;
+	  return;
+	}
+	c.offsets.push_back(b + i + 1 - base);
+	cells = 1;
+	mask &= mask - 1;
+      }
+      else if(cells <= p.width)
+      {
+	c.offsets.push_back(b + i + 1 - base);
+	++cells;
+	mask &= mask - 1;
+      }
+      else if(p.check)
+      {
+	// count the separators up to the next newline of the block at once
+	uint64_t nl = nlMask & mask;
+	uint64_t below = (nl? (nl & -nl) - 1: ~static_cast<uint64_t>(0));
+	cells += __builtin_popcountll(sepMask & mask & below);
+	mask &= ~below;
+      }
+      else
+      {
+	// resume scanning from the newline
+	const char* e = static_cast<const char*>(memchr(b + i, '\n', c.end - b - i));
+	next = (e? e: c.end);
+	break;
+      }
     }
+    b = next;
   }
-  if(row.size())
+
+  if(c.end[-1] == '\n')
   {
-    // missing final newline
-    cerr << file << ": warning: missing final newline!\n";
-    row.push_back(fix_string(s, p - s));
-    m->push_back(row);
+    // the start of the next row doubles as the end of this one
+    c.offsets.pop_back();
+  }
+  else
+  {
+    // remaining data without newline
+    ++c.rows;
+    if(cells != expected) c.ragged = true;
+    c.partial = true;
+  }
+}
+
+
+template<class T>
+struct parse_job: public parallel_job
+{
+  vector<parse_chunk<T> >& chunks;
+  const char* base;
+  const char sep;
+  const parse_proj* proj;
+
+  parse_job(vector<parse_chunk<T> >& chunks, const char* base, const char sep,
+      const parse_proj* proj)
+  : chunks(chunks), base(base), sep(sep), proj(proj)
+  {}
+
+  void
+  operator()(size_t i)
+  {
+    if(proj) projectChunk(chunks[i], base, sep, *proj);
+    else parseChunk(chunks[i], base, sep);
   }
+};
 
-  return m.release();
+
+template<class T>
+static void
+parseOffsets(vector<T>& offsets, size_t& rows, size_t& cols,
+    const char* addr, size_t len, const char* file, const char sep,
+    const parse_proj* proj, unsigned threads, string* log)
+{
+  if(!threads) threads = tblThreads();
+
+  // split at newline boundaries, with a few chunks per thread for balancing
+  size_t n = (threads > 1? threads * 4: 1);
+  size_t step = len / n;
+  if(step < parseChunkMin) step = parseChunkMin;
+
+  vector<parse_chunk<T> > chunks;
+  const char* end = addr + len;
+  for(const char* s = addr; s != end;)
+  {
+    const char* e = end;
+    if(static_cast<size_t>(end - s) > step)
+    {
+      e = static_cast<const char*>(memchr(s + step, '\n', end - s - step));
+      e = (e? e + 1: end);
+    }
+
+    chunks.push_back(parse_chunk<T>());
+    parse_chunk<T>& c = chunks.back();
+    c.begin = s;
+    c.end = e;
+    c.rows = c.cols = 0;
+    c.ragged = c.partial = false;
+    s = e;
+  }
+
+  parse_job<T> job(chunks, addr, sep, proj);
+  parallelRun(job, chunks.size(), threads);
+
+  // check the widths and stitch the chunks in order
+  rows = cols = 0;
+  size_t cells = 0;
+  for(typename vector<parse_chunk<T> >::const_iterator it = chunks.begin();
+      it != chunks.end(); ++it)
+  {
+    if(it->ragged || (rows && it->cols != cols))
+      throw runtime_error(sprintf2("%s: error: variable number of columns", file));
+    if(!rows) cols = it->cols;
+    rows += it->rows;
+    cells += it->offsets.size();
+  }
+  if(chunks.size() && chunks.back().partial)
+    fileWarning(log, file, "missing final newline!");
+
+  offsets.clear();
+  offsets.reserve(cells + 1);
+  for(typename vector<parse_chunk<T> >::iterator it = chunks.begin();
+      it != chunks.end(); ++it)
+  {
+    offsets.insert(offsets.end(), it->offsets.begin(), it->offsets.end());
+    vector<T>().swap(it->offsets);
+  }
+
+  // as if the final newline was always present
+  offsets.push_back(len + (chunks.size() && chunks.back().partial));
+  statsCount(stats_rows, rows);
+  statsCount(stats_cells, cells);
+}
+
+
+fix_table::~fix_table()
+{
+  if(idxAddr) munmap(idxAddr, idxLen);
+}
+
+
+void
+fix_table::parse(size_t len, const char* file, const char sep,
+    const parse_proj* proj, unsigned threads, string* log)
+{
+  wide = (static_cast<uint64_t>(len) >= UINT32_MAX);
+  if(wide)
+  {
+    parseOffsets(off64, rows_, cols_, base, len, file, sep, proj, threads, log);
+    o64 = &off64[0];
+  }
+  else
+  {
+    parseOffsets(off32, rows_, cols_, base, len, file, sep, proj, threads, log);
+    o32 = &off32[0];
+  }
+}
+
+
+fix_table*
+parseFixTable(const char* addr, size_t len, const char* file,
+    const char sep, unsigned threads, string* log)
+{
+  auto_ptr<fix_table> t(new fix_table);
+  t->base = addr;
+  t->parse(len, file, sep, NULL, threads, log);
+  return t.release();
+}
+
+
+fix_table*
+parseFixProjection(const char* addr, size_t len, const char* file,
+    const char sep, size_t width, size_t cols, bool check, unsigned threads)
+{
+  parse_proj proj;
+  proj.width = width;
+  proj.cols = cols;
+  proj.check = check;
+
+  auto_ptr<fix_table> t(new fix_table);
+  t->base = addr;
+  t->parse(len, file, sep, (width < cols? &proj: NULL), threads, NULL);
+  return t.release();
+}
+
+
+// layout of the .tblidx sidecar: this header, followed by the rows * cols + 1
+// cell offsets of fix_table in native byte order
+struct tblidx_header
+{
+  char magic[8];
+  uint32_t order;	// tblidxOrder, to detect foreign byte orders
+  uint8_t sep;
+  uint8_t wide;
+  uint8_t pad[2];
+  uint64_t size;	// of the data file
+  int64_t mtime;
+  int64_t mtimeNs;
+  uint64_t rows;
+  uint64_t cols;
+  uint8_t reserved[8];
+};
+
+static const char tblidxMagic[8] = {'T', 'B', 'L', 'I', 'D', 'X', '1', 0};
+static const uint32_t tblidxOrder = 0x01020304;
+
+
+static string
+indexFile(const char* file)
+{
+  return string(file) + ".tblidx";
+}
+
+
+// Check that the 'n' offsets of an index are usable with a table of 'size'
+// bytes: starting at 0, strictly increasing (each cell is followed by at
+// least its separator), and ending at the size (or one past it, for a
+// missing final newline).
+template<class T>
+static bool
+checkOffsets(const T* o, size_t n, uint64_t size)
+{
+  if(o[0] || (o[n - 1] != size && o[n - 1] != size + 1))
+    return false;
+  for(size_t i = 1; i != n; ++i)
+    if(o[i] <= o[i - 1]) return false;
+  return true;
+}
+
+
+fix_table*
+loadFixTableIndex(const char* addr, int fd, const char* file,
+    const char sep, string* log)
+{
+  struct stat dBuf;
+  if(fstat(fd, &dBuf)) return NULL;
+
+  const string idx = indexFile(file);
+  int ifd = open(idx.c_str(), O_RDONLY);
+  if(ifd < 0) return NULL;
+
+  struct stat iBuf;
+  void* iAddr = MAP_FAILED;
+  if(!fstat(ifd, &iBuf) && static_cast<size_t>(iBuf.st_size) >= sizeof(tblidx_header))
+    iAddr = mmap(NULL, iBuf.st_size, PROT_READ, MAP_SHARED, ifd, 0);
+  close(ifd);
+  if(iAddr == MAP_FAILED) return NULL;
+
+  // validate against the data file
+  const tblidx_header& h = *static_cast<const tblidx_header*>(iAddr);
+  const char* offsets = static_cast<const char*>(iAddr) + sizeof(h);
+  size_t width = (h.wide? sizeof(uint64_t): sizeof(uint32_t));
+  uint64_t cells = h.rows * h.cols;
+  if(memcmp(h.magic, tblidxMagic, sizeof(h.magic)) || h.order != tblidxOrder
+  || h.sep != static_cast<uint8_t>(sep) || h.size != static_cast<uint64_t>(dBuf.st_size)
+  || h.mtime != dBuf.st_mtim.tv_sec || h.mtimeNs != dBuf.st_mtim.tv_nsec
+  || (h.rows && (!h.cols || cells / h.cols != h.rows))
+  || cells >= static_cast<uint64_t>(iBuf.st_size) / width
+  || static_cast<uint64_t>(iBuf.st_size) != sizeof(h) + (cells + 1) * width
+  || (h.wide? !checkOffsets(reinterpret_cast<const uint64_t*>(offsets), cells + 1, h.size):
+      !checkOffsets(reinterpret_cast<const uint32_t*>(offsets), cells + 1, h.size)))
+  {
+    // stale, foreign or corrupt: parse the file instead
+    munmap(iAddr, iBuf.st_size);
+    return NULL;
+  }
+
+  auto_ptr<fix_table> t(new fix_table);
+  t->base = addr;
+  t->rows_ = h.rows;
+  t->cols_ = h.cols;
+  t->wide = h.wide;
+  t->idxAddr = iAddr;
+  t->idxLen = iBuf.st_size;
+  if(t->wide) t->o64 = reinterpret_cast<const uint64_t*>(offsets);
+  else t->o32 = reinterpret_cast<const uint32_t*>(offsets);
+
+  statsCount(stats_rows, h.rows);
+  statsCount(stats_cells, h.rows * h.cols);
+  if(t->offset(h.rows * h.cols) != h.size)
+    fileWarning(log, file, "missing final newline!");
+
+  return t.release();
+}
+
+
+void
+writeFixTableIndex(const fix_table& t, int fd, const char* file,
+    const char sep)
+{
+  struct stat dBuf;
+  if(fstat(fd, &dBuf))
+    throw runtime_error(sprintf2("%s: error: cannot stat file!", file));
+
+  tblidx_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, tblidxMagic, sizeof(h.magic));
+  h.order = tblidxOrder;
+  h.sep = sep;
+  h.wide = t.wide;
+  h.size = dBuf.st_size;
+  h.mtime = dBuf.st_mtim.tv_sec;
+  h.mtimeNs = dBuf.st_mtim.tv_nsec;
+  h.rows = t.rows_;
+  h.cols = t.cols_;
+
+  // write to a temporary name and rename, so that readers never see a
+  // partial index
+  const string idx = indexFile(file);
+  const string tmp = idx + ".tmp";
+  int ifd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(ifd < 0)
+    throw runtime_error(sprintf2("%s: error: cannot create file!", tmp.c_str()));
+
+  try
+  {
+    fix_writer out(ifd, tmp.c_str());
+    out.put(reinterpret_cast<const char*>(&h), sizeof(h));
+    size_t n = t.rows_ * t.cols_ + 1;
+    if(t.wide)
+      out.put(reinterpret_cast<const char*>(t.o64), n * sizeof(uint64_t));
+    else
+      out.put(reinterpret_cast<const char*>(t.o32), n * sizeof(uint32_t));
+    out.close();
+  }
+  catch(...)
+  {
+    close(ifd);
+    unlink(tmp.c_str());
+    throw;
+  }
+
+  if(close(ifd) || rename(tmp.c_str(), idx.c_str()))
+  {
+    unlink(tmp.c_str());
+    throw runtime_error(sprintf2("%s: error: cannot write file!", idx.c_str()));
+  }
+}
+
+
+/*
+ * Input strategies
+ */
+
+// block size for reads into owned buffers
+static const size_t ioBlockSize = 1 << 22;
+
+// reads in flight with io_uring
+static const unsigned ioRingDepth = 8;
+
+
+enum io_strategy
+{
+  io_mmap,		// plain mmap
+  io_mmap_sequential,	// mmap with sequential and huge page access hints
+  io_mmap_populate,	// as io_mmap, prefaulting the whole file
+  io_pread,		// large sequential preads into an owned buffer
+  io_uring		// as io_pread, keeping several reads in flight
+};
+
+static io_strategy ioSelected = io_mmap;
+static pthread_once_t ioOnce = PTHREAD_ONCE_INIT;
+
+
+static void
+ioStrategyInit()
+{
+  static const struct
+  {
+    const char* name;
+    io_strategy strategy;
+  } names[] =
+  {
+    {"mmap", io_mmap},
+    {"sequential", io_mmap_sequential},
+    {"populate", io_mmap_populate},
+    {"pread", io_pread},
+    {"uring", io_uring},
+  };
+
+  const char* env = getenv("TBLIO");
+  if(env && *env)
+  {
+    size_t i;
+    for(i = 0; i != ARRAY_LENGTH(names); ++i)
+      if(!strcmp(env, names[i].name)) break;
+    if(i != ARRAY_LENGTH(names))
+      ioSelected = names[i].strategy;
+    else
+      cerr << "warning: unknown TBLIO strategy \"" << env << "\"\n";
+  }
+}
+
+
+static io_strategy
+ioStrategy()
+{
+  // inputs can be loaded concurrently
+  pthread_once(&ioOnce, ioStrategyInit);
+  return ioSelected;
+}
+
+
+static char*
+allocInput(size_t len, const char* file)
+{
+  void* addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(addr == MAP_FAILED)
+    throw runtime_error(sprintf2("%s: error: cannot allocate memory!", file));
+#ifdef MADV_HUGEPAGE
+  madvise(addr, len, MADV_HUGEPAGE);
+#endif
+  return static_cast<char*>(addr);
+}
+
+
+static void
+preadFull(int fd, const char* file, char* buf, size_t n, uint64_t off)
+{
+  while(n)
+  {
+    ssize_t r = pread(fd, buf, n, off);
+    if(r < 0 && errno == EINTR) continue;
+    if(r <= 0)
+      throw runtime_error(sprintf2("%s: error: cannot read file!", file));
+    buf += r;
+    off += r;
+    n -= r;
+  }
+}
+
+
+static void
+preadInput(int fd, const char* file, char* buf, size_t len)
+{
+  for(size_t off = 0; off < len; off += ioBlockSize)
+    preadFull(fd, file, buf + off, min(ioBlockSize, len - off), off);
+}
+
+
+#ifdef __linux__
+
+// minimal io_uring ring, driven through the raw system calls
+struct uring
+{
+  int fd;
+  struct io_uring_params p;
+  void* sqRing;
+  size_t sqRingLen;
+  void* cqRing;
+  size_t cqRingLen;
+  struct io_uring_sqe* sqes;
+  size_t sqesLen;
+
+  uint32_t*
+  sq(uint32_t off) const
+  { return reinterpret_cast<uint32_t*>(static_cast<char*>(sqRing) + off); }
+
+  uint32_t*
+  cq(uint32_t off) const
+  { return reinterpret_cast<uint32_t*>(static_cast<char*>(cqRing) + off); }
+};
+
+
+static bool
+uringInit(uring& r, unsigned entries)
+{
+  memset(&r, 0, sizeof(r));
+  r.fd = syscall(__NR_io_uring_setup, entries, &r.p);
+  if(r.fd < 0) return false;
+
+  r.sqRingLen = r.p.sq_off.array + r.p.sq_entries * sizeof(uint32_t);
+  r.cqRingLen = r.p.cq_off.cqes + r.p.cq_entries * sizeof(struct io_uring_cqe);
+  if(r.p.features & IORING_FEAT_SINGLE_MMAP)
+    r.sqRingLen = r.cqRingLen = max(r.sqRingLen, r.cqRingLen);
+  r.sqesLen = r.p.sq_entries * sizeof(struct io_uring_sqe);
+
+  r.sqRing = mmap(NULL, r.sqRingLen, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQ_RING);
+  r.cqRing = (r.p.features & IORING_FEAT_SINGLE_MMAP? r.sqRing:
+      mmap(NULL, r.cqRingLen, PROT_READ | PROT_WRITE,
+	  MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_CQ_RING));
+  r.sqes = static_cast<struct io_uring_sqe*>(
+      mmap(NULL, r.sqesLen, PROT_READ | PROT_WRITE,
+	  MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQES));
+
+  if(r.sqRing == MAP_FAILED || r.cqRing == MAP_FAILED || r.sqes == MAP_FAILED)
+  {
+    if(r.sqRing != MAP_FAILED) munmap(r.sqRing, r.sqRingLen);
+    if(r.cqRing != MAP_FAILED && r.cqRing != r.sqRing) munmap(r.cqRing, r.cqRingLen);
+    if(r.sqes != MAP_FAILED) munmap(r.sqes, r.sqesLen);
+    close(r.fd);
+    return false;
+  }
+  return true;
+}
+
+
+static void
+uringFree(uring& r)
+{
+  munmap(r.sqes, r.sqesLen);
+  if(r.cqRing != r.sqRing) munmap(r.cqRing, r.cqRingLen);
+  munmap(r.sqRing, r.sqRingLen);
+  close(r.fd);
+}
+
+
+static void
+uringRead(uring& r, int fd, char* buf, uint32_t len, uint64_t off)
+{
+  uint32_t tail = *r.sq(r.p.sq_off.tail);
+  uint32_t i = tail & *r.sq(r.p.sq_off.ring_mask);
+  struct io_uring_sqe& e = r.sqes[i];
+  memset(&e, 0, sizeof(e));
+  e.opcode = IORING_OP_READ;
+  e.fd = fd;
+  e.addr = reinterpret_cast<uintptr_t>(buf);
+  e.len = len;
+  e.off = off;
+  e.user_data = off;
+  r.sq(r.p.sq_off.array)[i] = i;
+  __atomic_store_n(r.sq(r.p.sq_off.tail), tail + 1, __ATOMIC_RELEASE);
+}
+
+
+// read the whole file keeping up to ioRingDepth blocks in flight
+static bool
+uringInput(int fd, const char* file, char* buf, size_t len)
+{
+  uring r;
+  if(!uringInit(r, ioRingDepth))
+    return false;
+
+  size_t next = 0;
+  unsigned inFlight = 0;
+  unsigned queued = 0;	// not yet consumed by the kernel
+  bool done = false;	// a read completed
+  int error = 0;
+  vector<pair<uint64_t, size_t> > rest;	// remainder of the short reads
+
+  // after an error, stop queueing but wait for the reads still in flight:
+  // nothing can leave the loop while the kernel may write to 'buf'
+  while(inFlight || (!error && next < len))
+  {
+    for(; !error && next < len && inFlight != ioRingDepth; next += ioBlockSize)
+    {
+      uringRead(r, fd, buf + next, min(ioBlockSize, len - next), next);
+      ++inFlight;
+      ++queued;
+    }
+
+    // the kernel stops consuming at the first read failing submission
+    long ret = syscall(__NR_io_uring_enter, r.fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if(ret >= 0)
+      queued -= ret;
+    else if(errno != EINTR)
+    {
+      // reads never consumed are not in flight and are no longer submitted.
+      // When even waiting fails, poll the completion queue instead.
+      if(!error) error = errno;
+      inFlight -= queued;
+      queued = 0;
+      if(inFlight) sched_yield();
+    }
+
+    // reap the completions, finishing short reads after the loop
+    uint32_t head = *r.cq(r.p.cq_off.head);
+    const uint32_t mask = *r.cq(r.p.cq_off.ring_mask);
+    const struct io_uring_cqe* cqes = reinterpret_cast<const struct io_uring_cqe*>(
+	static_cast<char*>(r.cqRing) + r.p.cq_off.cqes);
+    for(; head != __atomic_load_n(r.cq(r.p.cq_off.tail), __ATOMIC_ACQUIRE); ++head)
+    {
+      const struct io_uring_cqe& c = cqes[head & mask];
+      uint64_t off = c.user_data;
+      size_t n = min(ioBlockSize, len - off);
+      --inFlight;
+      if(c.res < 0)
+      {
+	if(!error) error = -c.res;
+	continue;
+      }
+      done = true;
+      if(static_cast<size_t>(c.res) != n)
+	rest.push_back(make_pair(off + c.res, n - c.res));
+    }
+    __atomic_store_n(r.cq(r.p.cq_off.head), head, __ATOMIC_RELEASE);
+  }
+  uringFree(r);
+
+  if(error)
+  {
+    // kernels without IORING_OP_READ reject every read
+    if(error == EINVAL && !done) return false;
+    throw runtime_error(sprintf2("%s: error: cannot read file!", file));
+  }
+  for(size_t i = 0; i != rest.size(); ++i)
+    preadFull(fd, file, buf + rest[i].first, rest[i].second, rest[i].first);
+  return true;
+}
+
+#endif
+
+
+const char*
+loadInput(int fd, const char* file, size_t* len)
+{
+  struct stat stBuf;
+  if(fstat(fd, &stBuf))
+    throw runtime_error(sprintf2("%s: error: cannot stat file!", file));
+  *len = stBuf.st_size;
+  statsCount(stats_bytes_read, *len);
+  if(!*len) return "";
+
+  io_strategy strategy = ioStrategy();
+  if(strategy == io_mmap || strategy == io_mmap_sequential
+  || strategy == io_mmap_populate)
+  {
+    int flags = MAP_SHARED;
+    if(strategy == io_mmap_populate) flags |= MAP_POPULATE;
+    void* addr = mmap(NULL, *len, PROT_READ, flags, fd, 0);
+    if(addr == MAP_FAILED)
+      throw runtime_error(sprintf2("%s: error: cannot map file!", file));
+
+    if(strategy == io_mmap_sequential)
+    {
+      madvise(addr, *len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+      madvise(addr, *len, MADV_HUGEPAGE);
+#endif
+    }
+    return static_cast<const char*>(addr);
+  }
+
+  char* buf = allocInput(*len, file);
+  try
+  {
+#ifdef __linux__
+    if(strategy == io_uring && !uringInput(fd, file, buf, *len))
+    {
+      static int warned = 0;
+      if(!__sync_fetch_and_add(&warned, 1))
+	cerr << "warning: io_uring unavailable, using pread\n";
+      strategy = io_pread;
+    }
+#else
+    strategy = io_pread;
+#endif
+    if(strategy == io_pread)
+      preadInput(fd, file, buf, *len);
+  }
+  catch(...)
+  {
+    munmap(buf, *len);
+    throw;
+  }
+
+  // the cells never change
+  mprotect(buf, *len, PROT_READ);
+  return buf;
+}
+
+
+void
+unloadInput(const char* addr, size_t len)
+{
+  if(len) munmap(const_cast<char*>(addr), len);
+}
+
+
+int
+openInput(const char* file)
+{
+  int fd = (strcmp(file, "-")? open(file, O_RDONLY): STDIN_FILENO);
+  if(fd < 0)
+    throw runtime_error(sprintf2("%s: error: cannot open file!", file));
+  return fd;
+}
+
+
+bool
+isMappable(int fd)
+{
+  struct stat stBuf;
+  return (!fstat(fd, &stBuf) && S_ISREG(stBuf.st_mode));
+}
+
+
+fix_table*
+mapFixTable(const char** addr, int fd, const char* file, const char sep,
+    unsigned threads, string* log)
+{
+  size_t len;
+  *addr = NULL;
+  {
+    stats_phase phase("load");
+    *addr = loadInput(fd, file, &len);
+  }
+
+  // skip parsing entirely with a valid index
+  fix_table* t;
+  {
+    stats_phase phase("index");
+    t = (strcmp(file, "-")? loadFixTableIndex(*addr, fd, file, sep, log): NULL);
+  }
+  if(!t)
+  {
+    stats_phase phase("parse");
+    t = parseFixTable(*addr, len, file, sep, threads, log);
+  }
+  return t;
+}
+
+
+fix_table*
+mapFixTable(const char** addr, const char* file, const char sep,
+    int* fd, unsigned threads, string* log)
+{
+  // open the file
+  *addr = NULL;
+  int _fd = open(file, O_RDONLY);
+  if(fd) *fd = _fd;
+  if(_fd < 0)
+    throw runtime_error(sprintf2("%s: error: cannot open file!", file));
+
+  fix_table* t;
+  try { t = mapFixTable(addr, _fd, file, sep, threads, log); }
+  catch(...)
+  {
+    if(!fd) close(_fd);
+    throw;
+  }
+  if(!fd) close(_fd);
+
+  return t;
+}
+
+
+fix_string_matrix*
+toFixStringMatrix(const fix_table& t)
+{
+  auto_ptr<fix_string_matrix> m(new fix_string_matrix(t.rows()));
+  for(size_t y = 0; y != t.rows(); ++y)
+  {
+    vector<fix_string>& row = (*m)[y];
+    row.reserve(t.cols());
+    for(size_t x = 0; x != t.cols(); ++x)
+      row.push_back(t.cell(y, x));
+  }
+  return m.release();
+}
+
+
+fix_string_matrix*
+parseFixStringMatrix(const char* addr, size_t len, const char* file,
+    const char sep, unsigned threads)
+{
+  auto_ptr<fix_table> t(parseFixTable(addr, len, file, sep, threads));
+  return toFixStringMatrix(*t);
+}
+
+
+fix_string_matrix*
+mapFixStringMatrix(const char** addr, const char* file, const char sep,
+    int* fd, unsigned threads)
+{
+  auto_ptr<fix_table> t(mapFixTable(addr, file, sep, fd, threads));
+  return toFixStringMatrix(*t);
+}
+
+
+
+int
+tempFile()
+{
+  const char* dir = getenv("TMPDIR");
+  string path = string(dir && *dir? dir: "/tmp") + "/tblutils.XXXXXX";
+  vector<char> buf(path.begin(), path.end());
+  buf.push_back(0);
+
+  int fd = mkstemp(&buf[0]);
+  if(fd < 0)
+    throw runtime_error(sprintf2("%s: error: cannot create temporary file!", &buf[0]));
+  unlink(&buf[0]);
+  return fd;
+}
+
+
+void
+readAt(int fd, const char* file, char* buf, size_t n, uint64_t off)
+{
+  preadFull(fd, file, buf, n, off);
+  statsCount(stats_bytes_read, n);
+}
+
+
+/*
+ * Streamed tables
+ */
+
+// initial read buffer size
+static const size_t readBufferMin = 1 << 20;
+
+
+fix_row_reader::fix_row_reader(int fd, const char* file, const char sep,
+    size_t size)
+: fd(fd), file(file), sep(sep), buf(size? size: readBufferMin),
+  pos(0), len(0), scanned(0), cols(0), eof(false)
+{}
+
+
+bool
+fix_row_reader::fill()
+{
+  // reclaim the space of the consumed rows, growing only for long rows
+  if(pos)
+  {
+    memmove(&buf[0], &buf[pos], len - pos);
+    len -= pos;
+    pos = 0;
+  }
+  if(len == buf.size())
+    buf.resize(buf.size() * 2);
+
+  ssize_t n;
+  do n = read(fd, &buf[len], buf.size() - len);
+  while(n < 0 && errno == EINTR);
+  if(n < 0)
+    throw runtime_error(sprintf2("%s: error: cannot read file!", file));
+
+  len += n;
+  statsCount(stats_bytes_read, n);
+  return (n != 0);
+}
+
+
+bool
+fix_row_reader::next(vector<fix_string>& row)
+{
+  // locate the end of the row
+  const char* nl;
+  for(;;)
+  {
+    nl = static_cast<const char*>(memchr(&buf[pos + scanned], '\n', len - pos - scanned));
+    if(nl || eof) break;
+    scanned = len - pos;
+    eof = !fill();
+  }
+  scanned = 0;
+  if(!nl && pos == len)
+    return false;
+
+  const char* s = &buf[pos];
+  const char* e = (nl? nl: &buf[len]);
+  pos = e - &buf[0] + (nl != NULL);
+  if(!nl)
+  {
+    // missing final newline
+    cerr << file << ": warning: missing final newline!\n";
+  }
+  else if(e != s && *(e - 1) == '\r')
+    --e;
+
+  // split the cells
+  row.clear();
+  for(;;)
+  {
+    const char* p = static_cast<const char*>(memchr(s, sep, e - s));
+    if(!p) break;
+    row.push_back(fix_string(s, p - s));
+    s = p + 1;
+  }
+  row.push_back(fix_string(s, e - s));
+
+  if(!cols)
+    cols = row.size();
+  else if(row.size() != cols)
+    throw runtime_error(sprintf2("%s: error: variable number of columns", file));
+
+  statsCount(stats_rows, 1);
+  statsCount(stats_cells, cols);
+  return true;
+}
+
+
+
+/*
+ * Buffered output
+ */
+
+// size of each output buffer
+static const size_t writeBufferSize = 1 << 20;
+
+// smallest cell worth writing from its own location instead of copying
+static const size_t writeRefMin = 1 << 12;
+
+// maximum number of segments in a single buffer
+static const size_t writeSegsMax = 1024;
+
+
+static bool
+writeSegs(int fd, const vector<fix_string>& segs)
+{
+  vector<struct iovec> iov;
+  for(size_t i = 0; i != segs.size();)
+  {
+    iov.clear();
+    for(; i != segs.size() && iov.size() != IOV_MAX; ++i)
+    {
+      struct iovec v;
+      v.iov_base = const_cast<char*>(segs[i].data());
+      v.iov_len = segs[i].size();
+      if(v.iov_len) iov.push_back(v);
+    }
+
+    // handle short writes
+    struct iovec* v = (iov.size()? &iov[0]: NULL);
+    size_t n = iov.size();
+    while(n)
+    {
+      ssize_t r = writev(fd, v, n);
+      if(r < 0)
+      {
+	if(errno == EINTR) continue;
+	return false;
+      }
+      statsCount(stats_bytes_written, r);
+      for(; n && static_cast<size_t>(r) >= v->iov_len; ++v, --n)
+	r -= v->iov_len;
+      if(n)
+      {
+	v->iov_base = static_cast<char*>(v->iov_base) + r;
+	v->iov_len -= r;
+      }
+    }
+  }
+  return true;
+}
+
+
+struct writer_thread
+{
+  pthread_t tid;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int fd;
+  const vector<fix_string>* pending;
+  bool stop;
+  bool failed;
+};
+
+
+static void*
+writerWorker(void* arg)
+{
+  writer_thread& t = *static_cast<writer_thread*>(arg);
+  pthread_mutex_lock(&t.lock);
+  for(;;)
+  {
+    while(!t.pending && !t.stop)
+      pthread_cond_wait(&t.cond, &t.lock);
+    if(!t.pending) break;
+
+    // the pending buffer is released only once fully written
+    pthread_mutex_unlock(&t.lock);
+    bool ok = writeSegs(t.fd, *t.pending);
+    pthread_mutex_lock(&t.lock);
+    if(!ok) t.failed = true;
+    t.pending = NULL;
+    pthread_cond_broadcast(&t.cond);
+  }
+  pthread_mutex_unlock(&t.lock);
+  return NULL;
+}
+
+
+fix_writer::fix_writer(int fd, const char* file, bool async, size_t size)
+: fd(fd), file(file), thread(NULL)
+{
+  // the second buffer is only used by the writer thread
+  if(!size) size = writeBufferSize;
+  batches[0].buf.resize(size);
+  if(async) batches[1].buf.resize(size);
+  b = &batches[0];
+  cur = mark = &b->buf[0];
+  end = cur + b->buf.size();
+
+  if(async)
+  {
+    thread = new writer_thread;
+    thread->fd = fd;
+    thread->pending = NULL;
+    thread->stop = thread->failed = false;
+    pthread_mutex_init(&thread->lock, NULL);
+    pthread_cond_init(&thread->cond, NULL);
+    if(pthread_create(&thread->tid, NULL, writerWorker, thread))
+    {
+      // fallback to synchronous writes
+      pthread_cond_destroy(&thread->cond);
+      pthread_mutex_destroy(&thread->lock);
+      delete thread;
+      thread = NULL;
+    }
+  }
+}
+
+
+fix_writer::~fix_writer()
+{
+  try { close(); }
+  catch(...) {}
+
+  if(thread)
+  {
+    pthread_mutex_lock(&thread->lock);
+    thread->stop = true;
+    pthread_cond_broadcast(&thread->cond);
+    pthread_mutex_unlock(&thread->lock);
+    pthread_join(thread->tid, NULL);
+    pthread_cond_destroy(&thread->cond);
+    pthread_mutex_destroy(&thread->lock);
+    delete thread;
+  }
+}
+
+
+void
+fix_writer::cut()
+{
+  if(cur != mark)
+  {
+    b->segs.push_back(fix_string(mark, cur - mark));
+    mark = cur;
+  }
+}
+
+
+void
+fix_writer::flush()
+{
+  cut();
+  if(!b->segs.size()) return;
+
+  if(!thread)
+  {
+    if(!writeSegs(fd, b->segs))
+      throw runtime_error(sprintf2("%s: error: cannot write output!", file));
+  }
+  else
+  {
+    // wait for the previous buffer and swap
+    pthread_mutex_lock(&thread->lock);
+    while(thread->pending)
+      pthread_cond_wait(&thread->cond, &thread->lock);
+    bool failed = thread->failed;
+    if(!failed)
+    {
+      thread->pending = &b->segs;
+      pthread_cond_broadcast(&thread->cond);
+    }
+    pthread_mutex_unlock(&thread->lock);
+    if(failed)
+      throw runtime_error(sprintf2("%s: error: cannot write output!", file));
+
+    b = (b == &batches[0]? &batches[1]: &batches[0]);
+  }
+
+  b->segs.clear();
+  cur = mark = &b->buf[0];
+  end = cur + b->buf.size();
+}
+
+
+void
+fix_writer::close()
+{
+  flush();
+  if(thread)
+  {
+    pthread_mutex_lock(&thread->lock);
+    while(thread->pending)
+      pthread_cond_wait(&thread->cond, &thread->lock);
+    bool failed = thread->failed;
+    pthread_mutex_unlock(&thread->lock);
+    if(failed)
+      throw runtime_error(sprintf2("%s: error: cannot write output!", file));
+  }
+}
+
+
+void
+fix_writer::putSlow(const char* p, size_t n)
+{
+  flush();
+  if(n <= static_cast<size_t>(end - cur))
+  {
+    memcpy(cur, p, n);
+    cur += n;
+  }
+  else
+  {
+    // larger than the buffer: write directly
+    close();
+    b->segs.push_back(fix_string(p, n));
+    bool ok = writeSegs(fd, b->segs);
+    b->segs.clear();
+    if(!ok)
+      throw runtime_error(sprintf2("%s: error: cannot write output!", file));
+  }
+}
+
+
+void
+fix_writer::putMapped(const char* p, size_t n)
+{
+  if(n < writeRefMin)
+    put(p, n);
+  else
+  {
+    cut();
+    b->segs.push_back(fix_string(p, n));
+    if(b->segs.size() >= writeSegsMax)
+      flush();
+  }
 }
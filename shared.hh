@@ -33,6 +33,7 @@ using std::runtime_error;
 
 // c system headers
 #include <string.h>
+#include <stdint.h>
 using std::string;
 
 
@@ -99,6 +100,79 @@ public:
 
 
 
+/*
+ * Threading helpers
+ */
+
+// default number of worker threads (TBLTHREADS or the online CPU count)
+unsigned
+tblThreads();
+
+
+// a job split into independent, numbered units of work
+struct parallel_job
+{
+  virtual ~parallel_job() {}
+
+  virtual void
+  operator()(size_t i) = 0;
+};
+
+
+// run job(0) ... job(n - 1) on up to 'threads' threads (0: tblThreads()).
+// Errors raised by any unit are re-thrown as runtime_error in the caller.
+void
+parallelRun(parallel_job& job, size_t n, unsigned threads = 0);
+
+
+
+/*
+ * Statistics
+ */
+
+enum stats_counter
+{
+  stats_bytes_read,
+  stats_bytes_written,
+  stats_rows,
+  stats_cells,
+  stats_counters
+};
+
+
+// Enable the statistics summary for 'tool' when 'enable' is set or TBLSTATS
+// is defined ("json" selects JSON output). The summary is printed to stderr
+// at exit.
+void
+statsInit(const char* tool, bool enable = false);
+
+// add 'n' to a counter (thread-safe)
+void
+statsCount(stats_counter c, uint64_t n);
+
+
+// Account the wall and CPU time spent in a named phase, from construction to
+// destruction (or to end()). Phases are reported in order of first use. The
+// same phase can run on several threads at once: its times are summed.
+class stats_phase
+{
+  const char* name;
+  double wall;
+  double cpu;
+
+public:
+  explicit
+  stats_phase(const char* name);
+
+  ~stats_phase()
+  { end(); }
+
+  void
+  end();
+};
+
+
+
 /*
  * I/O helpers
  */
@@ -186,7 +260,352 @@ operator <<(ostream& buf, const fix_string& r)
 }
 
 
+/*
+ * Delimiter scanning
+ */
+
+// Set bit i of *sepMask (*nlMask) when p[i] is 'sep' (a newline), for the
+// n <= 64 bytes starting at p.
+typedef void (*delim_scan_fn)(const char* p, size_t n, const char sep,
+    uint64_t* sepMask, uint64_t* nlMask);
+
+// Best scanning kernel for the running CPU. TBLSIMD can force a specific
+// kernel ("scalar", "sse2", "avx2" or "avx512") when supported.
+delim_scan_fn
+delimScanKernel(const char** name = NULL);
+
+
+
+/*
+ * Mapped tables
+ */
+
 typedef vector<vector<fix_string> > fix_string_matrix;
 
+
+class fix_table;
+
+// Parse a whole table. Warnings are appended to 'log' when given, instead of
+// being written to cerr.
+fix_table*
+parseFixTable(const char* addr, size_t len, const char* file,
+    const char sep, unsigned threads = 0, string* log = NULL);
+
+// Parse only the first 'width' cells of each row of a table with 'cols'
+// columns: the rest of each row is left as a single, final cell, found with a
+// plain newline scan. With 'check', the separators of the rest are still
+// counted to validate the width of all rows. The whole table is parsed when
+// width >= cols.
+fix_table*
+parseFixProjection(const char* addr, size_t len, const char* file,
+    const char sep, size_t width, size_t cols, bool check,
+    unsigned threads = 0);
+
+
+// A row of a fix_table, indexed like a vector<fix_string>
+class fix_row
+{
+  const fix_table* t;
+  size_t y;
+
+public:
+  fix_row(const fix_table* t, size_t y)
+  : t(t), y(y)
+  {}
+
+  inline fix_string
+  operator[](size_t x) const;
+
+  inline size_t
+  size() const;
+};
+
+
+struct parse_proj;
+
+
+// Flat, read-only cell index of a mapped table: the start offset of every cell
+// (row-major, relative to the base address) plus one final sentinel. Each
+// cell ends one byte (the separator or newline) before the next one starts.
+// Offsets are 32 bits wide unless the table exceeds 4GB.
+class fix_table
+{
+  friend fix_table*
+  parseFixTable(const char* addr, size_t len, const char* file,
+      const char sep, unsigned threads, string* log);
+
+  friend fix_table*
+  parseFixProjection(const char* addr, size_t len, const char* file,
+      const char sep, size_t width, size_t cols, bool check,
+      unsigned threads);
+
+  friend fix_table*
+  loadFixTableIndex(const char* addr, int fd, const char* file,
+      const char sep, string* log);
+
+  friend void
+  writeFixTableIndex(const fix_table& t, int fd, const char* file,
+      const char sep);
+
+  const char* base;
+  size_t rows_;
+  size_t cols_;
+  bool wide;
+  const uint32_t* o32;
+  const uint64_t* o64;
+
+  // offsets storage: either owned or from a mapped index
+  vector<uint32_t> off32;
+  vector<uint64_t> off64;
+  void* idxAddr;
+  size_t idxLen;
+
+  fix_table()
+  : o32(NULL), o64(NULL), idxAddr(NULL), idxLen(0)
+  {}
+
+  fix_table(const fix_table&);
+  fix_table& operator=(const fix_table&);
+
+  void
+  parse(size_t len, const char* file, const char sep,
+      const parse_proj* proj, unsigned threads, string* log);
+
+  size_t
+  offset(size_t i) const
+  { return (wide? o64[i]: o32[i]); }
+
+public:
+  ~fix_table();
+
+  const char*
+  data() const
+  { return base; }
+
+  size_t
+  rows() const
+  { return rows_; }
+
+  size_t
+  cols() const
+  { return cols_; }
+
+  fix_string
+  cell(size_t y, size_t x) const
+  {
+    size_t i = y * cols_ + x;
+    size_t b = offset(i);
+    size_t len = offset(i + 1) - b - 1;
+    if(x == cols_ - 1 && len && base[b + len - 1] == '\r') --len;
+    return fix_string(base + b, len);
+  }
+
+  fix_row
+  operator[](size_t y) const
+  { return fix_row(this, y); }
+
+  fix_row
+  front() const
+  { return fix_row(this, 0); }
+};
+
+
+inline fix_string
+fix_row::operator[](size_t x) const
+{ return t->cell(y, x); }
+
+
+inline size_t
+fix_row::size() const
+{ return t->cols(); }
+
+
+fix_table*
+mapFixTable(const char** addr, const char* file, const char sep,
+    int* fd = NULL, unsigned threads = 0, string* log = NULL);
+
+// Load the table index of the data file open as fd (mapped at addr) from the
+// "file.tblidx" sidecar. Returns NULL when the sidecar is missing, does not
+// match the size, modification time or separator of the data file, or has
+// offsets which are out of order or out of the data file. Warnings go to 'log'
+// as with parseFixTable().
+fix_table*
+loadFixTableIndex(const char* addr, int fd, const char* file,
+    const char sep, string* log = NULL);
+
+// write the "file.tblidx" sidecar of the data file open as fd
+void
+writeFixTableIndex(const fix_table& t, int fd, const char* file,
+    const char sep);
+
+// expand a table into a modifiable matrix of cells
 fix_string_matrix*
-mapFixStringMatrix(const char** addr, const char* file, const char sep, int* fd = NULL);
+toFixStringMatrix(const fix_table& t);
+
+fix_string_matrix*
+parseFixStringMatrix(const char* addr, size_t len, const char* file,
+    const char sep, unsigned threads = 0);
+
+fix_string_matrix*
+mapFixStringMatrix(const char** addr, const char* file, const char sep,
+    int* fd = NULL, unsigned threads = 0);
+
+
+/*
+ * Streamed tables
+ */
+
+// open 'file' for reading ("-" is the standard input)
+int
+openInput(const char* file);
+
+// true when the open file can be mapped (a regular file)
+bool
+isMappable(int fd);
+
+fix_table*
+mapFixTable(const char** addr, int fd, const char* file, const char sep,
+    unsigned threads = 0, string* log = NULL);
+
+// Read or map the whole open file according to the TBLIO strategy ("mmap",
+// "sequential", "populate", "pread" or "uring"). The resulting memory is
+// read-only and can be released with unloadInput().
+const char*
+loadInput(int fd, const char* file, size_t* len);
+
+void
+unloadInput(const char* addr, size_t len);
+
+// create an anonymous (already unlinked) temporary file in TMPDIR
+int
+tempFile();
+
+// read exactly 'n' bytes at offset 'off' of fd
+void
+readAt(int fd, const char* file, char* buf, size_t n, uint64_t off);
+
+
+// Reads a table one row at a time from any file descriptor (including pipes),
+// using a single reusable buffer sized after the longest row.
+class fix_row_reader
+{
+  int fd;
+  const char* file;
+  const char sep;
+  vector<char> buf;
+  size_t pos;		// start of the next row
+  size_t len;		// amount of buffered data
+  size_t scanned;	// bytes past 'pos' known to contain no newline
+  size_t cols;
+  bool eof;
+
+  bool
+  fill();
+
+public:
+  // 'size' overrides the initial size of the input buffer
+  fix_row_reader(int fd, const char* file, const char sep, size_t size = 0);
+
+  // read the next row into 'row', returning false at the end of the input.
+  // The cells remain valid only until the following call.
+  bool
+  next(vector<fix_string>& row);
+};
+
+
+
+/*
+ * Buffered output
+ */
+
+struct writer_thread;
+
+
+// Output buffer for table cells, written with writev(2). Optionally, full
+// buffers are handed to a separate thread so that formatting overlaps with
+// the actual writes. Large cells which stay valid for the whole lifetime of
+// the writer (such as mapped memory) can be referenced instead of copied.
+class fix_writer
+{
+  struct batch
+  {
+    vector<char> buf;
+    vector<fix_string> segs;
+  };
+
+  int fd;
+  const char* file;
+  batch batches[2];
+  batch* b;
+  char* cur;
+  char* mark;	// start of the data not yet added to b->segs
+  char* end;
+  writer_thread* thread;
+
+  void
+  putSlow(const char* p, size_t n);
+
+  void
+  cut();
+
+public:
+  // 'size' overrides the size of the output buffer (when many are open)
+  fix_writer(int fd, const char* file, bool async = false, size_t size = 0);
+  ~fix_writer();
+
+  void
+  put(char c)
+  {
+    if(cur == end) flush();
+    *cur++ = c;
+  }
+
+  void
+  put(const char* p, size_t n)
+  {
+    // empty cells may come without data
+    if(!n) return;
+    if(n > static_cast<size_t>(end - cur)) putSlow(p, n);
+    else
+    {
+      memcpy(cur, p, n);
+      cur += n;
+    }
+  }
+
+  void
+  put(const fix_string& s)
+  { put(s.data(), s.size()); }
+
+  // as put(), but reference large cells without copying them
+  void
+  putMapped(const char* p, size_t n);
+
+  void
+  putMapped(const fix_string& s)
+  { putMapped(s.data(), s.size()); }
+
+  // hand the buffered data over for writing
+  void
+  flush();
+
+  // write out everything, waiting for the writer thread
+  void
+  close();
+};
+
+
+inline fix_writer&
+operator <<(fix_writer& buf, const fix_string& r)
+{
+  buf.put(r);
+  return buf;
+}
+
+
+inline fix_writer&
+operator <<(fix_writer& buf, const char c)
+{
+  buf.put(c);
+  return buf;
+}
@@ -11,6 +11,7 @@
 
 // local headers
 #include "shared.hh"
+#include "xlsx.hh"
 
 // base headers
 #include <string>
@@ -29,8 +30,12 @@ using std::max;
 #include <memory>
 using std::auto_ptr;
 
+#include <algorithm>
+
 // c headers
+#include <ctype.h>
 #include <locale.h>
+#include <math.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -45,7 +50,17 @@ using std::auto_ptr;
 const char x97HelperCmd[] = "tbl2excel-helper";
 const size_t x97RowLimit = 65535;
 const size_t x97ColLimit = 255;
-const char helperCmd[] = "tbl2excel-helper -x";
+const size_t xlsxRowLimit = 1048576;
+const size_t xlsxColLimit = 16384;
+
+// cells written by a single xlsx job
+const size_t xlsxChunkCells = 1 << 18;
+
+// rows of a column classified by a single job
+const size_t classifyChunkRows = 1 << 16;
+
+// seed of the sampled rows, for reproducible classifications
+const uint64_t classifySeed = 0x9E3779B97F4A7C15ULL;
 
 // detection constants
 const int defaultDetectThr = 99;
@@ -68,6 +83,15 @@ typedef vector<string> string_row;
 typedef vector<string_row> string_matrix;
 typedef map<string, datatype_t> type_map;
 
+// how a cell is written to an xlsx sheet
+enum cell_kind
+{
+  cell_empty,
+  cell_na,
+  cell_number,
+  cell_string
+};
+
 struct matrix_data
 {
   bool labels;
@@ -87,6 +111,16 @@ struct detect_params
   bool labels;
   bool coalesce;
   bool x97mode;
+  size_t sample;	// rows sampled to classify columns (0: all)
+};
+
+// type counts of (part of) a column
+struct type_counts
+{
+  size_t asInteger;
+  size_t asDouble;
+  size_t asString;
+  size_t asTotal;	// defined cells
 };
 
 
@@ -291,89 +325,135 @@ loadTxt(named_ifstream& fd, const detect_params& dp)
     }
 
     // save
+    statsCount(stats_cells, row.size());
     m->push_back(row);
     row.clear();
   }
 
+  statsCount(stats_bytes_read, fdSize);
+  statsCount(stats_rows, m->size());
   return m.release();
 }
 
 
 datatype_t
-classifyColumn(const detect_params& dp, size_t c,
-    string_matrix::const_iterator begin, string_matrix::const_iterator end)
+classifyCell(const detect_params& dp, const lconv* lc, const string& cell)
 {
-  size_t asInteger = 0;
-  size_t asDouble = 0;
-  size_t asString = 0;
-  size_t asTotal = (end - begin);
-  const lconv* lc = localeconv();
+  string buf = cell;
+  datatype_t t = unknown_type;
 
-  for(string_matrix::const_iterator it = begin; it != end; ++it)
+  if(buf.size())
   {
-    string buf = (*it)[c];
-    datatype_t t = unknown_type;
-
-    if(buf.size())
+    // NaNs
+    if(dp.undefStr.find(buf) != dp.undefStr.end())
+      t = unknown_type;
+    else
     {
-      // NaNs
-      if(dp.undefStr.find(buf) != dp.undefStr.end())
-	t = unknown_type;
-      else
+      // run simple character classification
+      t = int_type;
+      for(size_t i = 0; i != buf.size(); ++i)
       {
-	// run simple character classification
-	t = int_type;
-	for(size_t i = 0; i != buf.size(); ++i)
+	if(!isdigit(buf[i]) && (buf[i] != *lc->thousands_sep))
 	{
-	  if(!isdigit(buf[i]) && (buf[i] != *lc->thousands_sep))
+	  if(buf[i] == *lc->decimal_point)
+	    t = double_type;
+	  else
 	  {
-	    if(buf[i] == *lc->decimal_point)
-	      t = double_type;
-	    else
-	    {
-	      t = string_type;
-	      break;
-	    }
+	    t = string_type;
+	    break;
 	  }
 	}
       }
     }
+  }
 
-    // try complex double representations
-    if(t == string_type)
-    {
-      char* tmp;
+  // try complex double representations
+  if(t == string_type)
+  {
+    char* tmp;
 
-      // remove thousand separators
-      if(*lc->thousands_sep)
+    // remove thousand separators
+    if(*lc->thousands_sep)
+    {
+      string::iterator it = buf.begin();
+      while(it != buf.end())
       {
-	string::iterator it = buf.begin();
-	while(it != buf.end())
-	{
-	  if(*it == *lc->thousands_sep)
-	    buf.erase(it);
-	  else
-	    ++it;
-	}
+	if(*it == *lc->thousands_sep)
+	  buf.erase(it);
+	else
+	  ++it;
       }
-
-      strtod(buf.c_str(), &tmp);
-      if(!*tmp) t = double_type;
     }
 
-    switch(t)
+    strtod(buf.c_str(), &tmp);
+    if(!*tmp) t = double_type;
+  }
+
+  return t;
+}
+
+
+// Count the types of column c from begin to end. With a step, only one row
+// of each bucket of 'step' rows is counted, at a pseudo-random offset: the
+// sample stays spread out and reproducible, but cannot alias with periodic
+// data.
+void
+countColumn(type_counts& tc, const detect_params& dp, const lconv* lc, size_t c,
+    string_matrix::const_iterator begin, string_matrix::const_iterator end,
+    size_t step = 1)
+{
+  tc.asInteger = tc.asDouble = tc.asString = tc.asTotal = 0;
+  uint64_t seed = classifySeed;
+  for(string_matrix::const_iterator it = begin; it < end; it += step)
+  {
+    string_matrix::const_iterator row = it;
+    if(step > 1)
     {
-    case int_type: ++asInteger; break;
-    case double_type: ++asDouble; break;
-    case string_type: ++asString; break;
-    case unknown_type: --asTotal; break;
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      row += (seed >> 32) % min<size_t>(step, end - it);
     }
+    switch(classifyCell(dp, lc, (*row)[c]))
+    {
+    case int_type: ++tc.asInteger; break;
+    case double_type: ++tc.asDouble; break;
+    case string_type: ++tc.asString; break;
+    case unknown_type: continue;
+    }
+    ++tc.asTotal;
   }
+}
+
+
+// true when the counts of a sample settle the type of the column with a
+// safe margin from the detection threshold
+bool
+sampleConclusive(const detect_params& dp, const type_counts& tc)
+{
+  if(dp.exact || !tc.asTotal) return false;
+
+  // best and second best types
+  size_t v[] = {tc.asInteger, tc.asDouble, tc.asString};
+  std::sort(v, v + ARRAY_LENGTH(v));
+  double n = tc.asTotal;
+  double p1 = v[2] / n;
+  double p2 = v[1] / n;
+
+  // about two standard errors, but at least 3/n for unseen types
+  double m1 = 2 * sqrt(p1 * (1 - p1) / n) + 3 / n;
+  double m2 = 2 * sqrt(p2 * (1 - p2) / n) + 3 / n;
+  return ((p1 - m1) * 100 >= dp.detectThr && p1 - m1 > p2 + m2);
+}
+
+
+datatype_t
+classifyColumn(const detect_params& dp, const type_counts& tc)
+{
+  size_t asTotal = tc.asTotal;
 
   // scale to percentage with exact 0,100
-  asDouble = scale100(asDouble, asTotal);
-  asInteger = scale100(asInteger, asTotal);
-  asString = scale100(asString, asTotal);
+  size_t asDouble = scale100(tc.asDouble, asTotal);
+  size_t asInteger = scale100(tc.asInteger, asTotal);
+  size_t asString = scale100(tc.asString, asTotal);
 
   size_t asMax = max(max(asInteger, asDouble), asString);
   bool exact = asMax < (dp.exact? 100: dp.detectThr);
@@ -399,6 +479,50 @@ classifyColumn(const detect_params& dp, size_t c,
 }
 
 
+// Count the types of a set of column ranges, one range per unit
+struct classify_job: public parallel_job
+{
+  struct range
+  {
+    size_t col;
+    size_t begin;
+    size_t end;
+    size_t step;
+  };
+
+  const detect_params& dp;
+  string_matrix::const_iterator rows;
+  const lconv* lc;
+  vector<range> ranges;
+  vector<type_counts> counts;
+
+  classify_job(const detect_params& dp, string_matrix::const_iterator rows)
+  : dp(dp), rows(rows), lc(localeconv())
+  {}
+
+  void
+  add(size_t col, size_t begin, size_t end, size_t step = 1)
+  {
+    range r = {col, begin, end, step};
+    ranges.push_back(r);
+  }
+
+  void
+  run()
+  {
+    counts.resize(ranges.size());
+    parallelRun(*this, ranges.size());
+  }
+
+  void
+  operator()(size_t i)
+  {
+    const range& r = ranges[i];
+    countColumn(counts[i], dp, lc, r.col, rows + r.begin, rows + r.end, r.step);
+  }
+};
+
+
 datatype_t
 parseType(const char* p)
 {
@@ -443,31 +567,83 @@ classify(matrix_data& md, const detect_params& dp)
 {
   cerr << "columns:\n";
 
-  for(size_t c = 0; c != md.colTypes.size(); ++c)
-  {
-    string label(columnLabel(md, c));
-    type_map::const_iterator type(dp.colTypes.find(label));
+  size_t cols = md.colTypes.size();
+  string_matrix::const_iterator begin = md.m->begin() + md.labels;
+  size_t rows = md.m->end() - begin;
 
-    // column type
-    datatype_t t;
+  // fixed column types
+  vector<string> labels(cols);
+  vector<bool> detect(cols, false);
+  for(size_t c = 0; c != cols; ++c)
+  {
+    labels[c] = columnLabel(md, c);
+    type_map::const_iterator type(dp.colTypes.find(labels[c]));
     if(type != dp.colTypes.end())
-      t = type->second;
+      md.colTypes[c] = type->second;
     else if(dp.defType == unknown_type)
-      t = classifyColumn(dp, c, md.m->begin() + md.labels, md.m->end());
+      detect[c] = true;
     else
-      t = dp.defType;
+      md.colTypes[c] = dp.defType;
+  }
 
-    // save the result
-    md.colTypes[c] = t;
+  // try a sample spread over all the rows first
+  type_counts zero = {0, 0, 0, 0};
+  vector<type_counts> counts(cols, zero);
+  vector<bool> sampled(cols, false);
+  if(dp.sample && dp.sample < rows)
+  {
+    size_t step = rows / dp.sample;
+    classify_job job(dp, begin);
+    for(size_t c = 0; c != cols; ++c)
+      if(detect[c]) job.add(c, 0, step * dp.sample, step);
+    job.run();
+
+    for(size_t i = 0; i != job.ranges.size(); ++i)
+    {
+      size_t c = job.ranges[i].col;
+      if(sampleConclusive(dp, job.counts[i]))
+      {
+	counts[c] = job.counts[i];
+	sampled[c] = true;
+      }
+    }
+  }
+
+  // scan the remaining columns fully, in chunks of rows
+  classify_job job(dp, begin);
+  for(size_t c = 0; c != cols; ++c)
+  {
+    if(!detect[c] || sampled[c]) continue;
+    for(size_t y = 0; y < rows; y += classifyChunkRows)
+      job.add(c, y, min(rows, y + classifyChunkRows));
+  }
+  job.run();
+
+  for(size_t i = 0; i != job.ranges.size(); ++i)
+  {
+    type_counts& tc = counts[job.ranges[i].col];
+    const type_counts& r = job.counts[i];
+    tc.asInteger += r.asInteger;
+    tc.asDouble += r.asDouble;
+    tc.asString += r.asString;
+    tc.asTotal += r.asTotal;
+  }
+
+  for(size_t c = 0; c != cols; ++c)
+  {
+    // column type
+    if(detect[c]) md.colTypes[c] = classifyColumn(dp, counts[c]);
+    datatype_t t = md.colTypes[c];
 
     // show results
-    cerr << "  " << label << ": type ";
+    cerr << "  " << labels[c] << ": type ";
     switch(t)
     {
     case int_type: cerr << "integer"; break;
     case double_type: cerr << "double"; break;
     case string_type: cerr << "string"; break;
     }
+    if(sampled[c]) cerr << " (sampled)";
     cerr << std::endl;
   }
 }
@@ -556,6 +732,266 @@ output(FILE* fd, const string& sheetName, const matrix_data& md, const detect_pa
 }
 
 
+// true when 's' is a plain decimal number, which Excel reads as it is
+bool
+isDecimal(const string& s, char point)
+{
+  const char* p = s.c_str();
+  if(*p == '-') ++p;
+  if(!isdigit(*p)) return false;
+  while(isdigit(*p)) ++p;
+  if(*p == point)
+  {
+    if(!isdigit(*++p)) return false;
+    while(isdigit(*p)) ++p;
+  }
+  return !*p;
+}
+
+
+// Excel number for the cell 'buf' in 'dst', or false when not a number.
+// Without 'format', only check that the cell is a number ('dst' is scratch).
+bool
+xlsxNumber(string& dst, const string& buf, const lconv* lc, bool format = true)
+{
+  // plain decimals without thousand separators are checked in place
+  const char sep = *lc->thousands_sep;
+  if((!sep || buf.find(sep) == string::npos) && isDecimal(buf, *lc->decimal_point))
+  {
+    if(!format) return true;
+    dst = buf;
+    string::size_type p = dst.find(*lc->decimal_point);
+    if(p != string::npos) dst[p] = '.';
+    return true;
+  }
+
+  // remove thousand separators
+  dst.clear();
+  for(string::const_iterator it = buf.begin(); it != buf.end(); ++it)
+    if(!*lc->thousands_sep || *it != *lc->thousands_sep) dst += *it;
+
+  string::size_type p = dst.find(*lc->decimal_point);
+  if(isDecimal(dst, *lc->decimal_point))
+  {
+    if(p != string::npos) dst[p] = '.';
+    return true;
+  }
+
+  // any other representation accepted by strtod
+  char* end;
+  double v = strtod(dst.c_str(), &end);
+  if(end == dst.c_str() || *end || v != v || v - v != 0) return false;
+  if(!format) return true;
+
+  // shortest representation which reads back the same, with a C decimal point
+  dst = sprintf2("%.15g", v);
+  if(strtod(dst.c_str(), NULL) != v) dst = sprintf2("%.17g", v);
+  p = dst.find(*lc->decimal_point);
+  if(p != string::npos) dst[p] = '.';
+  return true;
+}
+
+
+// kind of the cell 'buf', without formatting numbers
+cell_kind
+xlsxCell(string& scratch, const string& buf, datatype_t t,
+    const detect_params& dp, const lconv* lc)
+{
+  if(dp.undefStr.find(buf) != dp.undefStr.end()) return cell_na;
+  if(buf.empty()) return cell_empty;
+  if(t != string_type && xlsxNumber(scratch, buf, lc, false)) return cell_number;
+  return cell_string;
+}
+
+
+void
+appendNum(string& dst, size_t v)
+{
+  char buf[24];
+  char* p = buf + sizeof(buf);
+  do *--p = '0' + v % 10;
+  while(v /= 10);
+  dst.append(p, buf + sizeof(buf) - p);
+}
+
+
+// Sheet rows, split in chunks of rows which are first scanned for the kind
+// of each cell (the strings to be numbered in order in the shared strings
+// table) and then written and compressed concurrently.
+struct xlsx_sheet_job: public parallel_job
+{
+  const matrix_data& md;
+  const detect_params& dp;
+  size_t first;			// first excel row (from 0)
+  size_t rows;
+  size_t cols;
+  size_t chunkRows;
+  vector<string> colNames;
+  vector<vector<char> > kinds;	// cell_kind of each cell
+  vector<vector<const string*> > strs;
+  vector<vector<uint32_t> > ids;
+  vector<xlsx_chunk> chunks;
+  bool collect;
+  const lconv* lc;
+
+  xlsx_sheet_job(const matrix_data& md, const detect_params& dp,
+      size_t first, size_t rows, size_t cols)
+  : md(md), dp(dp), first(first), rows(rows), cols(cols), collect(true),
+    lc(localeconv())
+  {
+    chunkRows = max<size_t>(1, xlsxChunkCells / cols);
+    size_t n = (rows + chunkRows - 1) / chunkRows;
+    kinds.resize(n);
+    strs.resize(n);
+    ids.resize(n);
+    chunks.resize(n);
+    for(size_t c = 0; c != cols; ++c)
+      colNames.push_back(xlsx_writer::columnName(c));
+  }
+
+  void
+  operator()(size_t i);
+};
+
+
+void
+xlsx_sheet_job::operator()(size_t i)
+{
+  size_t y = i * chunkRows;
+  size_t end = min(rows, y + chunkRows);
+  string_matrix::const_iterator it = md.m->begin() + md.labels + y;
+  string num;
+
+  if(collect)
+  {
+    kinds[i].reserve((end - y) * cols);
+    for(; y != end; ++y, ++it)
+    {
+      for(size_t c = 0; c != cols; ++c)
+      {
+	const string& buf = (*it)[c];
+	cell_kind k = xlsxCell(num, buf, md.colTypes[c], dp, lc);
+	kinds[i].push_back(k);
+	if(k == cell_string) strs[i].push_back(&buf);
+      }
+    }
+    return;
+  }
+
+  string xml;
+  vector<char>::const_iterator kind = kinds[i].begin();
+  vector<uint32_t>::const_iterator id = ids[i].begin();
+  for(; y != end; ++y, ++it)
+  {
+    string row;
+    appendNum(row, first + y + 1);
+    xml += "<row r=\"";
+    xml += row;
+    xml += "\">";
+
+    for(size_t c = 0; c != cols; ++c)
+    {
+      datatype_t t = md.colTypes[c];
+      const string& buf = (*it)[c];
+      cell_kind k = static_cast<cell_kind>(*kind++);
+      if(k == cell_empty) continue;
+
+      xml += "<c r=\"";
+      xml += colNames[c];
+      xml += row;
+      switch(k)
+      {
+      case cell_na:
+	xml += "\" t=\"e\"><f>NA()</f><v>#N/A</v></c>";
+	break;
+
+      case cell_number:
+	xlsxNumber(num, buf, lc);
+	xml += (t == double_type? "\" s=\"2\"><v>": "\"><v>");
+	xml += num;
+	xml += "</v></c>";
+	break;
+
+      default:
+	xml += "\" t=\"s\"><v>";
+	appendNum(xml, *id++);
+	xml += "</v></c>";
+      }
+    }
+    xml += "</row>";
+  }
+
+  deflateChunk(chunks[i], xml);
+  vector<char>().swap(kinds[i]);
+  vector<uint32_t>().swap(ids[i]);
+}
+
+
+void
+outputXlsx(xlsx_writer& xw, const string& sheetName, const matrix_data& md,
+    const detect_params& dp)
+{
+  size_t rows = md.m->end() - md.m->begin() - md.labels;
+  size_t cols = md.colTypes.size();
+  string head;
+  size_t first = 0;
+
+  // write a warning on the sheet if the conversion will overflow the Excel limits
+  if(cols > xlsxColLimit || md.m->size() > xlsxRowLimit)
+  {
+    head += "<row r=\"1\"><c r=\"A1\" t=\"s\" s=\"1\"><v>";
+    appendNum(head, xw.sharedString("WARNING: output truncated due to Excel row/column limits!"));
+    head += "</v></c></row>";
+    cerr << sheetName << ": warning: output truncated due to Excel row/column limits!\n";
+    ++first;
+    rows = min<size_t>(rows, xlsxRowLimit - 2);
+    cols = min<size_t>(cols, xlsxColLimit);
+  }
+
+  // write the labels table, if any
+  if(md.labels)
+  {
+    string row;
+    appendNum(row, ++first);
+    head += "<row r=\"" + row + "\">";
+    for(size_t c = 0; c != cols; ++c)
+    {
+      const string& buf = md.m->front()[c];
+      if(buf.empty()) continue;
+      head += "<c r=\"" + xlsx_writer::columnName(c) + row + "\" t=\"s\" s=\"1\"><v>";
+      appendNum(head, xw.sharedString(buf));
+      head += "</v></c>";
+    }
+    head += "</row>";
+  }
+
+  // collect the strings of all the rows, and number them in order
+  xlsx_sheet_job job(md, dp, first, rows, cols);
+  parallelRun(job, job.chunks.size());
+
+  Progress progress(rows, "rows");
+  for(size_t i = 0; i != job.strs.size(); ++i)
+  {
+    progress(i * job.chunkRows);
+    vector<const string*>& strs = job.strs[i];
+    job.ids[i].reserve(strs.size());
+    for(vector<const string*>::const_iterator it = strs.begin(); it != strs.end(); ++it)
+      job.ids[i].push_back(xw.sharedString(**it));
+    vector<const string*>().swap(strs);
+  }
+  progress.cleanup();
+
+  // write and compress
+  job.collect = false;
+  parallelRun(job, job.chunks.size());
+
+  vector<xlsx_chunk> body(1);
+  deflateChunk(body[0], head);
+  body.insert(body.end(), job.chunks.begin(), job.chunks.end());
+  xw.addSheet(sheetName, body);
+}
+
+
 // entry point
 int
 main(int argc, char* argv[]) try
@@ -568,11 +1004,13 @@ main(int argc, char* argv[]) try
   dp.exact = false;
   dp.relax = false;
   dp.x97mode = true;
+  dp.sample = 0;
   vector<string> names;
   bool help = false;
+  bool stats = false;
 
   int arg;
-  while((arg = getopt(argc, argv, "t:T:elcd:u:m:n:rxh")) != -1)
+  while((arg = getopt(argc, argv, "t:T:elcd:u:m:s:n:rxSh")) != -1)
     switch(arg)
     {
     case 't':
@@ -607,6 +1045,10 @@ main(int argc, char* argv[]) try
       dp.detectThr = strtoul(optarg, NULL, 10);
       break;
 
+    case 's':
+      dp.sample = strtoul(optarg, NULL, 10);
+      break;
+
     case 'n':
       tokenize(names, optarg, ",");
       break;
@@ -619,6 +1061,10 @@ main(int argc, char* argv[]) try
       dp.x97mode = !dp.x97mode;
       break;
 
+    case 'S':
+      stats = true;
+      break;
+
     case 'h':
       help = true;
       break;
@@ -632,7 +1078,7 @@ main(int argc, char* argv[]) try
   if(help || argc < 1)
   {
     if(!help) cerr << argv[0] << ": bad parameters:\n";
-    cerr << "Usage: " << argv[0] << " [-tTelcdumn] input [input ...]\n\n"
+    cerr << "Usage: " << argv[0] << " [-tTelcdumsn] input [input ...]\n\n"
 	 << "  -t type:\tuse TYPE type for all columns, do not autodetect\n"
 	 << "  -T col:type\tuse TYPE for the specified COLumn\n"
 	 << "  -e:\t\tensure EXACTness of all types/floating point conversions\n"
@@ -641,9 +1087,11 @@ main(int argc, char* argv[]) try
 	 << "  -d sep:\tuse SEP as the column separator, do not autodetect\n"
 	 << "  -u str:\tspecify a custom comma-separated list of undefined values\n"
 	 << "  -m thr:\tcolumn type autodetection minimum THReshold (default: " << defaultDetectThr << ")\n"
+	 << "  -s rows:\tautodetect column types on a sample of ROWS rows first\n"
 	 << "  -n str:\tassign sheet names for each input file\n"
 	 << "  -r:\t\trelax reader (continue reading on formatting errors)\n"
 	 << "  -x:\t\twrite XLSX (Excel 2012+) files instead of XLS (Excel 97-2003)\n"
+	 << "  -S:\t\tprint statistics at exit (see TBLSTATS)\n"
 	 << "  -h:\t\tthis help\n"
 	 << "\n"
 	 << "TYPE can be integer, double or string\n"
@@ -654,11 +1102,19 @@ main(int argc, char* argv[]) try
   // defaults
   setlocale(LC_ALL, "");
   if(!dp.undefStr.size()) uniqueTokens(dp.undefStr, defaultUndefStr);
-
-  // open comm with helper
-  const char* cmd = dp.x97mode? x97HelperCmd: helperCmd;
-  FILE* comm = popen(cmd, "w");
-  if(!comm) throw("popen failed");
+  statsInit("tbl2excel", stats);
+
+  // open comm with helper for XLS, write XLSX natively
+  const char* cmd = x97HelperCmd;
+  FILE* comm = NULL;
+  auto_ptr<xlsx_writer> xw;
+  if(!dp.x97mode)
+    xw.reset(new xlsx_writer(STDOUT_FILENO, "stdout"));
+  else
+  {
+    comm = popen(cmd, "w");
+    if(!comm) throw("popen failed");
+  }
 
   const char* inFile;
   for(size_t argn = 0; (inFile = argv[optind + argn]); ++argn)
@@ -675,6 +1131,7 @@ main(int argc, char* argv[]) try
     detect_params inDp = dp;
 
     cerr << "loading ...\n";
+    stats_phase loadPhase("load");
     if(!inDp.sep)
     {
       detectTxt(inFd, inDp);
@@ -684,6 +1141,7 @@ main(int argc, char* argv[]) try
     matrix_data md;
     md.labels = inDp.labels;
     md.m = loadTxt(inFd, inDp);
+    loadPhase.end();
 
     md.colTypes.resize(md.m->size()? md.m->front().size(): 0);
     cerr << "loaded " << md.m->size() << " rows x " << md.colTypes.size()
@@ -695,15 +1153,23 @@ main(int argc, char* argv[]) try
     }
 
     // classify columns
+    stats_phase classifyPhase("classify");
     classify(md, inDp);
+    classifyPhase.end();
 
     // output
     string sheetName = (argn < names.size()? names[argn]: inFile);
     cerr << "writing sheet \"" << sheetName << "\"...\n";
-    output(comm, sheetName.c_str(), md, inDp);
+    stats_phase outputPhase("output");
+    if(xw.get()) outputXlsx(*xw, sheetName, md, inDp);
+    else output(comm, sheetName.c_str(), md, inDp);
+    outputPhase.end();
+    delete md.m;
   }
 
-  if(pclose(comm))
+  if(xw.get())
+    xw->close();
+  else if(pclose(comm))
   {
     cerr << argv[0] << ": error: " << cmd << " failed\n";
     return EXIT_FAILURE;
@@ -11,16 +11,22 @@
 #include "shared.hh"
 
 // system headers
+#include <memory>
+using std::auto_ptr;
+
 #include <map>
 using std::multimap;
 using std::make_pair;
 
 #include <algorithm>
 using std::find;
+using std::max;
 
 // c headers
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 
 /*
@@ -30,6 +36,41 @@ using std::find;
 typedef multimap<string, size_t> col_map;
 
 
+// A run of adjacent selected columns, written as a single slice of the row
+// (the separators in between are the same on output)
+struct col_run
+{
+  size_t first;
+  size_t last;
+};
+
+
+// A column selection (-f/-n/-c) together with its output file (-o)
+struct cut_output
+{
+  vector<string> fieldNames;
+  vector<size_t> fieldNums;
+  bool complement;
+  const char* file;	// "-" for the standard output
+  vector<size_t> cols;
+  vector<col_run> runs;
+  int fd;
+  fix_writer* out;
+
+  cut_output()
+  : complement(false), file("-"), fd(-1), out(NULL)
+  {}
+
+  bool
+  empty() const
+  { return !fieldNames.size() && !fieldNums.size() && !complement; }
+
+  bool
+  valid() const
+  { return !fieldNames.size() != !fieldNums.size(); }
+};
+
+
 /*
  * Implementation
  */
@@ -38,29 +79,227 @@ void
 help(char* argv[])
 {
   cerr << argv[0] << ": bad parameters:\n"
-       << "Usage: " << argv[0] << " [-hd] < -f col,col,... | -n col,col,... > file\n"
+       << "Usage: " << argv[0] << " [-hcu] [-d sep] < -f col,col,... | -n col,col,... > [-o out ...] file|-\n"
        << "tblcut allows to extract single columns by name from the selected CSV file.\n"
        << "CSV files are TAB separated, containing column labels on the first row. You\n"
        << "can change the column separator by setting the TBLSEP environment variable.\n"
+       << "Use '-' as the file name to read from the standard input.\n"
        << "\n"
        << "  -d sep:		set a different column separator\n"
        << "  -f col,col,...:	extract the selected column names\n"
        << "  -n col,col,...:	extract the selected column numbers\n"
        << "  -c:			complement the selected fields\n"
+       << "  -o out:		write the selection given so far to 'out', and start\n"
+       << "  			a new one (the last selection defaults to stdout)\n"
+       << "  -u:			do not check the width of rows past the last selected column\n"
+       << "  -S:			print statistics at exit (see TBLSTATS)\n"
        << "  -h:			help summary\n";
 }
 
 
+bool
+buildCols(vector<size_t>& cols, const vector<fix_string>& header,
+    const char* file, const vector<string>& fieldNames,
+    const vector<size_t>& fieldNums, bool complement)
+{
+  if(fieldNums.size())
+  {
+    // check arguments
+    for(vector<size_t>::const_iterator it = fieldNums.begin();
+	it != fieldNums.end(); ++it)
+    {
+      if(!*it || *it > header.size())
+      {
+	cerr << file << ": invalid column number " << *it << "\n";
+	return false;
+      }
+    }
+
+    // from column numbers
+    if(!complement)
+    {
+      for(vector<size_t>::const_iterator it = fieldNums.begin();
+	  it != fieldNums.end(); ++it)
+	cols.push_back(*it - 1);
+    }
+    else
+    {
+      for(size_t i = 0; i != header.size(); ++i)
+      {
+	if(find(fieldNums.begin(), fieldNums.end(), i + 1) == fieldNums.end())
+	  cols.push_back(i);
+      }
+    }
+  }
+  else
+  {
+    // from column names
+    if(!complement)
+    {
+      col_map cmap;
+      for(size_t i = 0; i != header.size(); ++i)
+      {
+	cmap.insert(make_pair(string(header[i]), i));
+      }
+
+      for(vector<string>::const_iterator it = fieldNames.begin();
+	  it != fieldNames.end(); ++it)
+      {
+	col_map::const_iterator cIt = cmap.lower_bound(*it);
+	if(cIt == cmap.end())
+	{
+	  cerr << file << ": unknown column \"" << *it << "\"\n";
+	  return false;
+	}
+
+	for(col_map::const_iterator cEnd = cmap.upper_bound(*it);
+	    cIt != cEnd; ++cIt)
+	  cols.push_back(cIt->second);
+      }
+    }
+    else
+    {
+      for(size_t i = 0; i != header.size(); ++i)
+      {
+	if(find(fieldNames.begin(), fieldNames.end(), string(header[i])) == fieldNames.end())
+	  cols.push_back(i);
+      }
+    }
+  }
+
+
+  return true;
+}
+
+
+// split the first row of the mapped table at addr
+void
+splitHeader(vector<fix_string>& header, const char* addr, size_t len,
+    const char sep)
+{
+  if(!len) return;
+  const char* end = static_cast<const char*>(memchr(addr, '\n', len));
+  if(!end) end = addr + len;
+  if(end != addr && end[-1] == '\r') --end;
+
+  for(const char* p = addr;; ++p)
+  {
+    const char* e = static_cast<const char*>(memchr(p, sep, end - p));
+    if(!e) e = end;
+    header.push_back(fix_string(p, e - p));
+    if(e == end) break;
+    p = e;
+  }
+}
+
+
+// merge the adjacent selected columns into runs
+void
+planRuns(vector<col_run>& runs, const vector<size_t>& cols)
+{
+  for(vector<size_t>::const_iterator it = cols.begin(); it != cols.end(); ++it)
+  {
+    if(runs.size() && runs.back().last + 1 == *it)
+      runs.back().last = *it;
+    else
+    {
+      col_run r = {*it, *it};
+      runs.push_back(r);
+    }
+  }
+}
+
+
+template<class R>
+void
+writeRow(fix_writer& out, const R& row, const vector<col_run>& runs,
+    const char sep, bool mapped)
+{
+  for(vector<col_run>::const_iterator it = runs.begin(); it != runs.end(); ++it)
+  {
+    if(it != runs.begin()) out << sep;
+    fix_string c = row[it->first];
+    if(it->last != it->first)
+    {
+      fix_string l = row[it->last];
+      c = fix_string(c.data(), l.data() + l.size() - c.data());
+    }
+    if(mapped) out.putMapped(c);
+    else out << c;
+  }
+  out << '\n';
+}
+
+
+// write all the rows of each output, one output per unit
+struct cut_job: public parallel_job
+{
+  const fix_table& t;
+  vector<cut_output>& outputs;
+  const char sep;
+
+  cut_job(const fix_table& t, vector<cut_output>& outputs, const char sep)
+  : t(t), outputs(outputs), sep(sep)
+  {}
+
+  void
+  operator()(size_t i)
+  {
+    cut_output& o = outputs[i];
+    for(size_t y = 0; y != t.rows(); ++y)
+      writeRow(*o.out, t[y], o.runs, sep, true);
+    o.out->close();
+  }
+};
+
+
+void
+openOutputs(vector<cut_output>& outputs)
+{
+  bool async = (tblThreads() > 1);
+  for(vector<cut_output>::iterator it = outputs.begin(); it != outputs.end(); ++it)
+  {
+    if(!strcmp(it->file, "-"))
+    {
+      it->fd = STDOUT_FILENO;
+      it->out = new fix_writer(it->fd, "stdout", async);
+    }
+    else
+    {
+      it->fd = open(it->file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if(it->fd < 0)
+	throw runtime_error(sprintf2("%s: error: cannot create file!", it->file));
+      it->out = new fix_writer(it->fd, it->file, async);
+    }
+  }
+}
+
+
+void
+closeOutputs(vector<cut_output>& outputs)
+{
+  for(vector<cut_output>::iterator it = outputs.begin(); it != outputs.end(); ++it)
+  {
+    it->out->close();
+    delete it->out;
+    it->out = NULL;
+    if(it->fd != STDOUT_FILENO && close(it->fd))
+      throw runtime_error(sprintf2("%s: error: cannot write file!", it->file));
+  }
+}
+
+
 int
 main(int argc, char* argv[]) try
 {
-  vector<string> fieldNames;
-  vector<size_t> fieldNums;
-  bool complement = false;
+  vector<cut_output> outputs;
+  cut_output sel;
+  bool check = true;
+  bool stats = false;
   char sep = 0;
 
   int arg;
-  while((arg = getopt(argc, argv, "hf:n:d:c")) != -1)
+  while((arg = getopt(argc, argv, "hf:n:d:co:uS")) != -1)
     switch(arg)
     {
     case 'h':
@@ -72,7 +311,7 @@ main(int argc, char* argv[]) try
       break;
 
     case 'f':
-      tokenize(fieldNames, optarg, ",", true);
+      tokenize(sel.fieldNames, optarg, ",", true);
       break;
 
     case 'n':
@@ -80,24 +319,41 @@ main(int argc, char* argv[]) try
 	vector<string> tmp;
 	tokenize(tmp, optarg, ",", true);
 	for(vector<string>::iterator it = tmp.begin(); it != tmp.end(); ++it)
-	  fieldNums.push_back(strtoul(it->c_str(), NULL, 0));
+	  sel.fieldNums.push_back(strtoul(it->c_str(), NULL, 0));
       }
       break;
 
     case 'c':
-      complement = !complement;
+      sel.complement = !sel.complement;
+      break;
+
+    case 'o':
+      sel.file = optarg;
+      outputs.push_back(sel);
+      sel = cut_output();
+      break;
+
+    case 'u':
+      check = false;
+      break;
+
+    case 'S':
+      stats = true;
       break;
 
     default:
       return EXIT_FAILURE;
     }
+  if(!sel.empty() || !outputs.size())
+    outputs.push_back(sel);
 
   // check args
   argc -= optind;
   const char* file(argv[optind++]);
-  if(argc != 1
-  || (fieldNames.size() && fieldNums.size())
-  || (!fieldNames.size() && !fieldNums.size()))
+  bool valid = (argc == 1);
+  for(vector<cut_output>::const_iterator it = outputs.begin(); it != outputs.end(); ++it)
+    valid = valid && it->valid();
+  if(!valid)
   {
     help(argv);
     return EXIT_FAILURE;
@@ -112,87 +368,82 @@ main(int argc, char* argv[]) try
   }
 
   // open the file
-  const char* addr;
-  fix_string_matrix& m = *mapFixStringMatrix(&addr, file, sep);
-
-  // build the resulting column list
-  vector<size_t> cols;
-  if(fieldNums.size())
+  statsInit("tblcut", stats);
+  int fd = openInput(file);
+  if(isMappable(fd))
   {
-    // check arguments
-    for(vector<size_t>::const_iterator it = fieldNums.begin();
-	it != fieldNums.end(); ++it)
+    size_t len;
+    const char* addr;
     {
-      if(!*it || *it > m.front().size())
-      {
-	cerr << file << ": invalid column number " << *it << "\n";
-	return EXIT_FAILURE;
-      }
+      stats_phase phase("load");
+      addr = loadInput(fd, file, &len);
+    }
+    auto_ptr<fix_table> m;
+    {
+      stats_phase phase("index");
+      if(strcmp(file, "-")) m.reset(loadFixTableIndex(addr, fd, file, sep));
     }
 
-    // from column numbers
-    if(!complement)
+    vector<fix_string> header;
+    if(m.get())
     {
-      for(vector<size_t>::const_iterator it = fieldNums.begin();
-	  it != fieldNums.end(); ++it)
-	cols.push_back(*it - 1);
+      for(size_t i = 0; i != m->cols(); ++i)
+	header.push_back(m->cell(0, i));
     }
     else
+      splitHeader(header, addr, len, sep);
+
+    size_t width = 0;
+    for(vector<cut_output>::iterator it = outputs.begin(); it != outputs.end(); ++it)
     {
-      for(size_t i = 0; i != m.front().size(); ++i)
-      {
-	if(find(fieldNums.begin(), fieldNums.end(), i + 1) == fieldNums.end())
-	  cols.push_back(i);
-      }
+      if(!buildCols(it->cols, header, file, it->fieldNames, it->fieldNums, it->complement))
+	return EXIT_FAILURE;
+      planRuns(it->runs, it->cols);
+      for(vector<size_t>::const_iterator c = it->cols.begin(); c != it->cols.end(); ++c)
+	width = max(width, *c + 1);
     }
+
+    if(!m.get())
+    {
+      // split the rows only up to the last column selected by any output
+      stats_phase phase("parse");
+      m.reset(parseFixProjection(addr, len, file, sep, width, header.size(), check));
+    }
+
+    // output, writing each selection concurrently
+    openOutputs(outputs);
+    stats_phase phase("output");
+    cut_job job(*m, outputs, sep);
+    parallelRun(job, outputs.size());
   }
   else
   {
-    // from column names
-    if(!complement)
+    // stream pipes one row at a time
+    stats_phase phase("stream");
+    fix_row_reader in(fd, file, sep);
+    vector<fix_string> row;
+    if(!in.next(row)) row.clear();
+    for(vector<cut_output>::iterator it = outputs.begin(); it != outputs.end(); ++it)
     {
-      col_map cmap;
-      for(size_t i = 0; i != m.front().size(); ++i)
-      {
-	const string cname = m.front()[i];
-	cmap.insert(make_pair(string(m.front()[i]), i));
-      }
-
-      for(vector<string>::const_iterator it = fieldNames.begin();
-	  it != fieldNames.end(); ++it)
-      {
-	col_map::const_iterator cIt = cmap.lower_bound(*it);
-	if(cIt == cmap.end())
-	{
-	  cerr << file << ": unknown column \"" << *it << "\"\n";
-	  return EXIT_FAILURE;
-	}
-
-	for(col_map::const_iterator cEnd = cmap.upper_bound(*it);
-	    cIt != cEnd; ++cIt)
-	  cols.push_back(cIt->second);
-      }
+      if(!buildCols(it->cols, row, file, it->fieldNames, it->fieldNums, it->complement))
+	return EXIT_FAILURE;
+      planRuns(it->runs, it->cols);
     }
-    else
+
+    // output
+    openOutputs(outputs);
+    if(row.size())
     {
-      for(vector<fix_string>::const_iterator it = m.front().begin();
-	  it != m.front().end(); ++it)
+      do
       {
-	if(find(fieldNames.begin(), fieldNames.end(), string(*it)) == fieldNames.end())
-	  cols.push_back(it - m.front().begin());
+	for(vector<cut_output>::iterator it = outputs.begin(); it != outputs.end(); ++it)
+	  writeRow(*it->out, row, it->runs, sep, false);
       }
+      while(in.next(row));
     }
   }
-
-  // output
-  for(fix_string_matrix::const_iterator it = m.begin(); it != m.end(); ++it)
-  {
-    vector<size_t>::const_iterator it2 = cols.begin();
-    cout << (*it)[*it2];
-    for(++it2; it2 != cols.end(); ++it2)
-      cout << sep << (*it)[*it2];
-    cout << '\n';
-  }
+  stats_phase phase("flush");
+  closeOutputs(outputs);
 }
 catch(runtime_error& e)
 {
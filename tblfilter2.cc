@@ -0,0 +1,1300 @@
+/*
+ * tblfilter2: fast row filter - implementation
+ * Copyright(c) 2009 EURAC, Institute of Genetic Medicine
+ */
+
+/*
+ * Headers
+ */
+
+// local headers
+#include "shared.hh"
+
+// system headers
+#include <map>
+using std::map;
+using std::make_pair;
+
+#include <deque>
+using std::deque;
+
+#include <algorithm>
+using std::min;
+
+// c headers
+#include <stdlib.h>
+#include <stdio.h>
+#include <strings.h>
+#include <unistd.h>
+#include <regex.h>
+#include <math.h>
+
+
+/*
+ * Types and constants
+ */
+
+// rows filtered by each unit of work
+const size_t chunkRows = 1 << 16;
+
+// chunks filtered concurrently for each thread
+const size_t chunksPerThread = 4;
+
+// column labels, last occurrence of each label (as $L{} in tblfilter)
+typedef map<string, size_t> col_map;
+
+
+enum expr_type
+{
+  type_num,
+  type_str
+};
+
+
+enum expr_op
+{
+  op_col_str,		// push the string of column 'arg'
+  op_col_num,		// push the number of column 'arg'
+  op_num,		// push numeric constant 'arg'
+  op_str,		// push string constant 'arg'
+  op_to_num,
+  op_to_str,
+  op_num_truth,		// number to 0/1
+  op_str_truth,		// string to 0/1 ("" and "0" are false)
+  op_not,
+  op_neg,
+  op_add,
+  op_sub,
+  op_mul,
+  op_div,
+  op_mod,
+  op_concat,
+  op_num_cmp,		// compare numbers as 'arg' (a cmp_kind)
+  op_str_cmp,		// compare strings as 'arg'
+  op_match,		// match regex 'arg'
+  op_jump_false,	// jump to 'arg' keeping a false top, pop otherwise
+  op_jump_true,		// jump to 'arg' keeping a true top, pop otherwise
+  op_abs,
+  op_int,
+  op_length,
+  op_lc,
+  op_uc
+};
+
+
+enum cmp_kind
+{
+  cmp_eq,
+  cmp_ne,
+  cmp_lt,
+  cmp_le,
+  cmp_gt,
+  cmp_ge
+};
+
+
+struct expr_instr
+{
+  expr_op op;
+  size_t arg;
+
+  expr_instr(expr_op op, size_t arg)
+  : op(op), arg(arg)
+  {}
+};
+
+
+// A compiled expression: bytecode for a stack machine, plus constants
+struct expr_program
+{
+  vector<expr_instr> code;
+  vector<double> nums;
+  vector<string> strs;
+  vector<string> regexes;
+  vector<int> regexFlags;
+  size_t stack;			// maximum stack depth
+  expr_type type;		// type of the result
+};
+
+
+// a value on the evaluation stack
+struct expr_value
+{
+  double n;
+  fix_string s;
+
+  expr_value()
+  : n(0), s(NULL, 0)
+  {}
+};
+
+
+/*
+ * Implementation
+ */
+
+void
+help(char* argv[])
+{
+  cerr << argv[0] << ": bad parameters:\n"
+       << "Usage: " << argv[0] << " [-h] -e expression file|-\n"
+       << "Filter the rows of the specified CSV file through an expression. CSV files\n"
+       << "are TAB separated, containing column labels on the first row. You can\n"
+       << "change the column separator by setting the TBLSEP environment variable.\n"
+       << "Just the lines for which the expression is true are returned. You can refer\n"
+       << "to $N[x] for column positions or $L{name} (or just $name) for column labels\n"
+       << "relative to the current row. For example:\n"
+       << "\n"
+       << "  -e '$N[1] > 1':		returns all the lines for which the first column is > 1\n"
+       << "  -e '$L{test} eq \"a\"':	returns all the lines for which the column 'test' is 'a'\n"
+       << "\n"
+       << "  -e expr:	filter expression (see the manual for the syntax)\n"
+       << "  -S:		print statistics at exit (see TBLSTATS)\n"
+       << "  -h:		help summary\n";
+}
+
+
+// Parse the leading number of a string as Perl does: leading spaces, sign,
+// digits with an optional fraction and exponent, or "inf"/"nan". Anything
+// else is 0.
+double
+toNumber(const char* p, size_t n)
+{
+  const char* e = p + n;
+  while(p != e && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) ++p;
+
+  const char* s = p;
+  if(p != e && (*p == '+' || *p == '-')) ++p;
+  const char* d = p;
+  while(p != e && *p >= '0' && *p <= '9') ++p;
+  bool digits = (p != d);
+  if(p != e && *p == '.')
+  {
+    const char* f = ++p;
+    while(p != e && *p >= '0' && *p <= '9') ++p;
+    digits = digits || p != f;
+  }
+  if(!digits)
+  {
+    // special values
+    size_t r = e - d;
+    double v = 0;
+    if(r >= 3 && !strncasecmp(d, "inf", 3)) v = HUGE_VAL;
+    else if(r >= 3 && !strncasecmp(d, "nan", 3)) v = NAN;
+    return (*s == '-'? -v: v);
+  }
+  if(p != e && (*p == 'e' || *p == 'E'))
+  {
+    const char* x = p + 1;
+    if(x != e && (*x == '+' || *x == '-')) ++x;
+    if(x != e && *x >= '0' && *x <= '9')
+    {
+      p = x;
+      while(p != e && *p >= '0' && *p <= '9') ++p;
+    }
+  }
+
+  char buf[64];
+  size_t len = p - s;
+  if(len >= sizeof(buf)) return strtod(string(s, len).c_str(), NULL);
+  memcpy(buf, s, len);
+  buf[len] = 0;
+  return strtod(buf, NULL);
+}
+
+
+// Translate the Perl escapes of a regular expression to POSIX ERE: the
+// classes \d \s \w and their negations, \t \n \r, and escaped characters
+// within brackets (where POSIX takes the backslash literally). Other escapes
+// of letters or digits (such as \b or back-references) have no ERE meaning
+// and are rejected instead of silently matching the bare character.
+string
+posixRegex(const string& re)
+{
+  static const struct { char c; const char* out; const char* in; } classes[] =
+  {
+    { 'd', "[0-9]", "0-9" },
+    { 'D', "[^0-9]", NULL },
+    { 's', "[[:space:]]", "[:space:]" },
+    { 'S', "[^[:space:]]", NULL },
+    { 'w', "[[:alnum:]_]", "[:alnum:]_" },
+    { 'W', "[^[:alnum:]_]", NULL }
+  };
+
+  string dst;
+  bool bracket = false;
+  for(size_t i = 0; i != re.size(); ++i)
+  {
+    char c = re[i];
+    if(!bracket && c == '[')
+    {
+      // a leading ']' is part of the set
+      bracket = true;
+      dst += c;
+      if(i + 1 != re.size() && re[i + 1] == '^') dst += re[++i];
+      if(i + 1 != re.size() && re[i + 1] == ']') dst += re[++i];
+      continue;
+    }
+    if(bracket && c == '[' && i + 1 != re.size()
+	&& (re[i + 1] == ':' || re[i + 1] == '.' || re[i + 1] == '='))
+    {
+      // [:class:], [.coll.] and [=equiv=] are copied as is
+      size_t e = re.find(string(1, re[i + 1]) + "]", i + 2);
+      if(e != string::npos)
+      {
+	dst.append(re, i, e + 2 - i);
+	i = e + 1;
+	continue;
+      }
+    }
+    if(bracket && c == ']') bracket = false;
+    if(c != '\\' || i + 1 == re.size())
+    {
+      dst += c;
+      continue;
+    }
+
+    char e = re[++i];
+    const char* cls = NULL;
+    for(size_t k = 0; k != ARRAY_LENGTH(classes); ++k)
+      if(classes[k].c == e) cls = (bracket? classes[k].in: classes[k].out);
+    if(cls)
+      dst += cls;
+    else if(e == 't') dst += '\t';
+    else if(e == 'n') dst += '\n';
+    else if(e == 'r') dst += '\r';
+    else if(isalnum((unsigned char)e))
+    {
+      throw runtime_error(sprintf2("error: invalid regular expression \"%s\":"
+	      " unsupported escape \"\\%c\"%s", re.c_str(), e,
+	      (bracket? " within brackets": "")));
+    }
+    else if(!bracket)
+    {
+      dst += '\\';
+      dst += e;
+    }
+    else if(strchr("[]^-", e))
+    {
+      // as a collating symbol, valid anywhere in the set
+      dst += "[.";
+      dst += e;
+      dst += ".]";
+    }
+    else
+      dst += e;
+  }
+  return dst;
+}
+
+
+// Compiles an expression in a single pass, emitting bytecode as operands and
+// operators are parsed. Operands are converted to the type required by each
+// operator right after being parsed.
+class expr_compiler
+{
+  const string src;
+  size_t pos;
+  expr_program& prog;
+  const col_map& labels;
+  size_t cols;
+  const char* file;
+  size_t depth;
+
+  void
+  error(const char* what)
+  {
+    throw runtime_error(sprintf2("error: %s in expression at \"%s\"",
+	    what, src.substr(pos).c_str()));
+  }
+
+  void
+  emit(expr_op op, size_t arg, int delta)
+  {
+    prog.code.push_back(expr_instr(op, arg));
+    depth += delta;
+    if(depth > prog.stack) prog.stack = depth;
+  }
+
+  void
+  skip()
+  {
+    while(pos != src.size() && isspace((unsigned char)src[pos])) ++pos;
+  }
+
+  // accept an operator
+  bool
+  accept(const char* tok)
+  {
+    skip();
+    size_t n = strlen(tok);
+    if(src.compare(pos, n, tok)) return false;
+    pos += n;
+    return true;
+  }
+
+  // accept a keyword, not followed by other word characters
+  bool
+  acceptWord(const char* word)
+  {
+    skip();
+    size_t n = strlen(word);
+    if(src.compare(pos, n, word)) return false;
+    if(pos + n != src.size() && (isalnum((unsigned char)src[pos + n]) || src[pos + n] == '_'))
+      return false;
+    pos += n;
+    return true;
+  }
+
+  void
+  expect(const char* tok)
+  {
+    if(!accept(tok)) error(sprintf2("expected \"%s\"", tok).c_str());
+  }
+
+  void
+  toNum(expr_type& t)
+  {
+    if(t == type_num) return;
+    if(prog.code.back().op == op_col_str)
+      prog.code.back().op = op_col_num;
+    else
+      emit(op_to_num, 0, 0);
+    t = type_num;
+  }
+
+  void
+  toStr(expr_type& t)
+  {
+    if(t == type_str) return;
+    emit(op_to_str, 0, 0);
+    t = type_str;
+  }
+
+  void
+  toBool(expr_type& t)
+  {
+    if(t == type_str)
+      emit(op_str_truth, 0, 0);
+    else
+    {
+      switch(prog.code.back().op)
+      {
+      case op_num_cmp: case op_str_cmp: case op_match: case op_not:
+      case op_num_truth: case op_str_truth:
+	break;
+
+      default:
+	emit(op_num_truth, 0, 0);
+      }
+    }
+    t = type_num;
+  }
+
+  string
+  quoted();
+
+  size_t
+  column();
+
+  expr_type
+  primary();
+
+  expr_type
+  unary();
+
+  expr_type
+  match();
+
+  expr_type
+  mul();
+
+  expr_type
+  add();
+
+  expr_type
+  cmp();
+
+  size_t
+  jumpShort(expr_type& t, expr_op op);
+
+  void
+  endShort(expr_type r, size_t jump);
+
+  expr_type
+  logicalAnd();
+
+  expr_type
+  logicalOr();
+
+  expr_type
+  wordNot();
+
+  expr_type
+  wordAnd();
+
+  expr_type
+  wordOr();
+
+public:
+  expr_compiler(const string& src, expr_program& prog, const col_map& labels,
+      size_t cols, const char* file)
+  : src(src), pos(0), prog(prog), labels(labels), cols(cols), file(file),
+    depth(0)
+  {}
+
+  void
+  compile();
+};
+
+
+// string literal, with backslash escapes
+string
+expr_compiler::quoted()
+{
+  char q = src[pos++];
+  string buf;
+  for(; pos != src.size() && src[pos] != q; ++pos)
+  {
+    if(src[pos] == '\\' && pos + 1 != src.size())
+    {
+      char c = src[++pos];
+      if(q == '"' && c == 't') c = '\t';
+      else if(q == '"' && c == 'n') c = '\n';
+      else if(c != q && c != '\\') buf += '\\';
+      buf += c;
+    }
+    else
+      buf += src[pos];
+  }
+  if(pos == src.size()) error("unterminated string");
+  ++pos;
+  return buf;
+}
+
+
+// column reference: $N[x], $L{name} or $name
+size_t
+expr_compiler::column()
+{
+  if(src.compare(pos, 2, "N[") == 0)
+  {
+    pos += 2;
+    skip();
+    char* end;
+    long n = strtol(src.c_str() + pos, &end, 10);
+    if(end == src.c_str() + pos) error("expected a column number");
+    pos = end - src.c_str();
+    expect("]");
+    if(n < 0) n += cols + 1;
+    if(n < 1 || (size_t)n > cols)
+      throw runtime_error(sprintf2("%s: invalid column number %ld", file, n));
+    return n - 1;
+  }
+
+  string name;
+  if(src.compare(pos, 2, "L{") == 0)
+  {
+    pos += 2;
+    skip();
+    if(pos != src.size() && (src[pos] == '\'' || src[pos] == '"'))
+    {
+      name = quoted();
+      expect("}");
+    }
+    else
+    {
+      size_t e = src.find('}', pos);
+      if(e == string::npos) error("expected \"}\"");
+      name = src.substr(pos, e - pos);
+      pos = e + 1;
+    }
+  }
+  else
+  {
+    size_t s = pos;
+    while(pos != src.size() && (isalnum((unsigned char)src[pos]) || src[pos] == '_'))
+      ++pos;
+    if(s == pos) error("expected a column");
+    name = src.substr(s, pos - s);
+  }
+
+  col_map::const_iterator it = labels.find(name);
+  if(it == labels.end())
+    throw runtime_error(sprintf2("%s: unknown column \"%s\"", file, name.c_str()));
+  return it->second;
+}
+
+
+expr_type
+expr_compiler::primary()
+{
+  skip();
+  if(pos == src.size()) error("unexpected end");
+  char c = src[pos];
+
+  if(c == '(')
+  {
+    ++pos;
+    expr_type t = wordOr();
+    expect(")");
+    return t;
+  }
+
+  // as in Perl, "not" can start an operand, extending up to "and" or "or",
+  // unless called as a function
+  size_t start = pos;
+  if(acceptWord("not"))
+  {
+    if(!accept("("))
+    {
+      pos = start;
+      return wordNot();
+    }
+    expr_type t = wordOr();
+    expect(")");
+    toBool(t);
+    emit(op_not, 0, 0);
+    return t;
+  }
+
+  if(c == '$')
+  {
+    ++pos;
+    emit(op_col_str, column(), 1);
+    return type_str;
+  }
+
+  if(c == '\'' || c == '"')
+  {
+    prog.strs.push_back(quoted());
+    emit(op_str, prog.strs.size() - 1, 1);
+    return type_str;
+  }
+
+  if(isdigit((unsigned char)c) || c == '.')
+  {
+    char* end;
+    double v = strtod(src.c_str() + pos, &end);
+    if(end == src.c_str() + pos) error("invalid number");
+    pos = end - src.c_str();
+    prog.nums.push_back(v);
+    emit(op_num, prog.nums.size() - 1, 1);
+    return type_num;
+  }
+
+  // functions of a single argument
+  static const struct { const char* name; expr_op op; expr_type arg; expr_type ret; } funcs[] =
+  {
+    { "abs", op_abs, type_num, type_num },
+    { "int", op_int, type_num, type_num },
+    { "length", op_length, type_str, type_num },
+    { "lc", op_lc, type_str, type_str },
+    { "uc", op_uc, type_str, type_str }
+  };
+  for(size_t i = 0; i != ARRAY_LENGTH(funcs); ++i)
+  {
+    if(!acceptWord(funcs[i].name)) continue;
+    expect("(");
+    expr_type t = wordOr();
+    if(funcs[i].arg == type_num) toNum(t);
+    else toStr(t);
+    expect(")");
+    emit(funcs[i].op, 0, 0);
+    return funcs[i].ret;
+  }
+
+  error("syntax error");
+  return type_num;
+}
+
+
+expr_type
+expr_compiler::unary()
+{
+  if(accept("!"))
+  {
+    expr_type t = unary();
+    toBool(t);
+    emit(op_not, 0, 0);
+    return t;
+  }
+  if(accept("-"))
+  {
+    expr_type t = unary();
+    toNum(t);
+    emit(op_neg, 0, 0);
+    return t;
+  }
+  if(accept("+"))
+  {
+    expr_type t = unary();
+    toNum(t);
+    return t;
+  }
+  return primary();
+}
+
+
+// regex matching: expr =~ /re/i or expr =~ "re"
+expr_type
+expr_compiler::match()
+{
+  expr_type t = unary();
+  skip();
+  bool neg;
+  if(accept("=~")) neg = false;
+  else if(accept("!~")) neg = true;
+  else return t;
+
+  toStr(t);
+  skip();
+  string re;
+  int flags = REG_EXTENDED | REG_NOSUB;
+  if(pos != src.size() && src[pos] == '/')
+  {
+    for(++pos; pos != src.size() && src[pos] != '/'; ++pos)
+    {
+      if(src[pos] == '\\' && pos + 1 != src.size() && src[pos + 1] == '/')
+	++pos;
+      else if(src[pos] == '\\' && pos + 1 != src.size())
+	re += src[pos++];
+      re += src[pos];
+    }
+    if(pos == src.size()) error("unterminated regular expression");
+    for(++pos; pos != src.size() && isalpha((unsigned char)src[pos]); ++pos)
+    {
+      if(src[pos] == 'i') flags |= REG_ICASE;
+      else error("unsupported regular expression flag");
+    }
+  }
+  else if(pos != src.size() && (src[pos] == '\'' || src[pos] == '"'))
+    re = quoted();
+  else
+    error("expected a regular expression");
+
+  // check the syntax now
+  re = posixRegex(re);
+  regex_t tmp;
+  int err = regcomp(&tmp, re.c_str(), flags);
+  if(err)
+  {
+    char buf[256];
+    regerror(err, &tmp, buf, sizeof(buf));
+    throw runtime_error(sprintf2("error: invalid regular expression \"%s\": %s",
+	    re.c_str(), buf));
+  }
+  regfree(&tmp);
+
+  prog.regexes.push_back(re);
+  prog.regexFlags.push_back(flags);
+  emit(op_match, prog.regexes.size() - 1, 0);
+  if(neg) emit(op_not, 0, 0);
+  return type_num;
+}
+
+
+expr_type
+expr_compiler::mul()
+{
+  expr_type t = match();
+  for(;;)
+  {
+    expr_op op;
+    if(accept("*")) op = op_mul;
+    else if(accept("/")) op = op_div;
+    else if(accept("%")) op = op_mod;
+    else return t;
+
+    toNum(t);
+    expr_type r = match();
+    toNum(r);
+    emit(op, 0, -1);
+  }
+}
+
+
+expr_type
+expr_compiler::add()
+{
+  expr_type t = mul();
+  for(;;)
+  {
+    skip();
+    expr_op op;
+    if(accept("+")) op = op_add;
+    else if(accept("-")) op = op_sub;
+    else if(pos != src.size() && src[pos] == '.'
+	&& !(pos + 1 != src.size() && isdigit((unsigned char)src[pos + 1])))
+    {
+      ++pos;
+      op = op_concat;
+    }
+    else return t;
+
+    if(op == op_concat)
+    {
+      toStr(t);
+      expr_type r = mul();
+      toStr(r);
+    }
+    else
+    {
+      toNum(t);
+      expr_type r = mul();
+      toNum(r);
+    }
+    emit(op, 0, -1);
+  }
+}
+
+
+expr_type
+expr_compiler::cmp()
+{
+  expr_type t = add();
+
+  static const struct { const char* tok; bool word; expr_op op; cmp_kind kind; } ops[] =
+  {
+    { "==", false, op_num_cmp, cmp_eq },
+    { "!=", false, op_num_cmp, cmp_ne },
+    { "<=", false, op_num_cmp, cmp_le },
+    { ">=", false, op_num_cmp, cmp_ge },
+    { "<", false, op_num_cmp, cmp_lt },
+    { ">", false, op_num_cmp, cmp_gt },
+    { "eq", true, op_str_cmp, cmp_eq },
+    { "ne", true, op_str_cmp, cmp_ne },
+    { "le", true, op_str_cmp, cmp_le },
+    { "ge", true, op_str_cmp, cmp_ge },
+    { "lt", true, op_str_cmp, cmp_lt },
+    { "gt", true, op_str_cmp, cmp_gt }
+  };
+  for(size_t i = 0; i != ARRAY_LENGTH(ops); ++i)
+  {
+    if(!(ops[i].word? acceptWord(ops[i].tok): accept(ops[i].tok)))
+      continue;
+
+    if(ops[i].op == op_num_cmp)
+    {
+      toNum(t);
+      expr_type r = add();
+      toNum(r);
+    }
+    else
+    {
+      toStr(t);
+      expr_type r = add();
+      toStr(r);
+    }
+    emit(ops[i].op, ops[i].kind, -1);
+    return type_num;
+  }
+  return t;
+}
+
+
+// Short-circuit operators leave their left operand as the result when it
+// decides, jumping over the right operand.
+size_t
+expr_compiler::jumpShort(expr_type& t, expr_op op)
+{
+  toBool(t);
+  size_t jump = prog.code.size();
+  emit(op, 0, -1);
+  return jump;
+}
+
+
+void
+expr_compiler::endShort(expr_type r, size_t jump)
+{
+  toBool(r);
+  prog.code[jump].arg = prog.code.size();
+}
+
+
+// As in Perl, from the tightest: "&&", "||", "not", "and", "or"
+expr_type
+expr_compiler::logicalAnd()
+{
+  expr_type t = cmp();
+  while(accept("&&"))
+  {
+    size_t jump = jumpShort(t, op_jump_false);
+    endShort(cmp(), jump);
+  }
+  return t;
+}
+
+
+expr_type
+expr_compiler::logicalOr()
+{
+  expr_type t = logicalAnd();
+  while(accept("||"))
+  {
+    size_t jump = jumpShort(t, op_jump_true);
+    endShort(logicalAnd(), jump);
+  }
+  return t;
+}
+
+
+expr_type
+expr_compiler::wordNot()
+{
+  // "not(...)" is a function call, see primary()
+  size_t start = pos;
+  if(!acceptWord("not")) return logicalOr();
+  if(accept("("))
+  {
+    pos = start;
+    return logicalOr();
+  }
+  expr_type t = wordNot();
+  toBool(t);
+  emit(op_not, 0, 0);
+  return t;
+}
+
+
+expr_type
+expr_compiler::wordAnd()
+{
+  expr_type t = wordNot();
+  while(acceptWord("and"))
+  {
+    size_t jump = jumpShort(t, op_jump_false);
+    endShort(wordNot(), jump);
+  }
+  return t;
+}
+
+
+expr_type
+expr_compiler::wordOr()
+{
+  expr_type t = wordAnd();
+  while(acceptWord("or"))
+  {
+    size_t jump = jumpShort(t, op_jump_true);
+    endShort(wordAnd(), jump);
+  }
+  return t;
+}
+
+
+void
+expr_compiler::compile()
+{
+  prog.stack = 0;
+  expr_type t = wordOr();
+  skip();
+  if(pos != src.size()) error("syntax error");
+  toBool(t);
+  prog.type = t;
+}
+
+
+// Evaluates a program on rows. Each evaluator has its own stack, scratch
+// strings and compiled regular expressions, so that evaluators can run
+// concurrently.
+class expr_eval
+{
+  const expr_program& prog;
+  vector<expr_value> stack;
+  vector<regex_t> regexes;
+  deque<string> scratch;	// strings computed for the current row
+  size_t used;
+  char buf[64];
+
+  fix_string
+  store(const string& s)
+  {
+    if(used == scratch.size()) scratch.push_back(string());
+    string& dst = scratch[used++];
+    dst = s;
+    return fix_string(dst.data(), dst.size());
+  }
+
+  fix_string
+  format(double v)
+  {
+    int n = snprintf(buf, sizeof(buf), "%.15g", v);
+    return store(string(buf, n));
+  }
+
+  static bool
+  compare(int r, size_t kind)
+  {
+    switch(kind)
+    {
+    case cmp_eq: return r == 0;
+    case cmp_ne: return r != 0;
+    case cmp_lt: return r < 0;
+    case cmp_le: return r <= 0;
+    case cmp_gt: return r > 0;
+    default: return r >= 0;
+    }
+  }
+
+  static bool
+  compareNum(double a, double b, size_t kind)
+  {
+    // NaN is only different from anything
+    if(a != a || b != b) return kind == cmp_ne;
+    return compare((a < b? -1: (a > b? 1: 0)), kind);
+  }
+
+  bool
+  matches(size_t i, const fix_string& s)
+  {
+    regmatch_t m;
+    m.rm_so = 0;
+    m.rm_eo = s.size();
+    const char* p = (s.size()? s.data(): "");
+    return !regexec(&regexes[i], p, 1, &m, REG_STARTEND);
+  }
+
+public:
+  explicit
+  expr_eval(const expr_program& prog)
+  : prog(prog), stack(prog.stack + 1), used(0)
+  {
+    regexes.resize(prog.regexes.size());
+    for(size_t i = 0; i != regexes.size(); ++i)
+      regcomp(&regexes[i], prog.regexes[i].c_str(), prog.regexFlags[i]);
+  }
+
+  ~expr_eval()
+  {
+    foreach(vector<regex_t>, it, regexes)
+      regfree(&*it);
+  }
+
+  // true when the row passes the filter; errors (division by zero) reject
+  // the row, as with tblfilter
+  template<class R>
+  bool
+  operator()(const R& row);
+};
+
+
+template<class R>
+bool
+expr_eval::operator()(const R& row)
+{
+  used = 0;
+  expr_value* sp = &stack[0] - 1;
+  const expr_instr* code = &prog.code[0];
+  const size_t n = prog.code.size();
+  for(size_t pc = 0; pc != n; ++pc)
+  {
+    const expr_instr& i = code[pc];
+    switch(i.op)
+    {
+    case op_col_str:
+      (++sp)->s = row[i.arg];
+      break;
+
+    case op_col_num:
+      {
+	fix_string c = row[i.arg];
+	(++sp)->n = toNumber(c.data(), c.size());
+      }
+      break;
+
+    case op_num:
+      (++sp)->n = prog.nums[i.arg];
+      break;
+
+    case op_str:
+      (++sp)->s = fix_string(prog.strs[i.arg].data(), prog.strs[i.arg].size());
+      break;
+
+    case op_to_num:
+      sp->n = toNumber(sp->s.data(), sp->s.size());
+      break;
+
+    case op_to_str:
+      sp->s = format(sp->n);
+      break;
+
+    case op_num_truth:
+      sp->n = (sp->n != 0);
+      break;
+
+    case op_str_truth:
+      sp->n = (sp->s.size() && !(sp->s.size() == 1 && *sp->s.data() == '0'));
+      break;
+
+    case op_not:
+      sp->n = !sp->n;
+      break;
+
+    case op_neg:
+      sp->n = -sp->n;
+      break;
+
+    case op_add:
+      --sp;
+      sp->n += sp[1].n;
+      break;
+
+    case op_sub:
+      --sp;
+      sp->n -= sp[1].n;
+      break;
+
+    case op_mul:
+      --sp;
+      sp->n *= sp[1].n;
+      break;
+
+    case op_div:
+      --sp;
+      if(!sp[1].n) return false;
+      sp->n /= sp[1].n;
+      break;
+
+    case op_mod:
+      {
+	// integer modulus, with the sign of the right operand
+	--sp;
+	long long a = (long long)sp->n;
+	long long b = (long long)sp[1].n;
+	if(!b) return false;
+	long long r = a % b;
+	if(r && ((r < 0) != (b < 0))) r += b;
+	sp->n = r;
+      }
+      break;
+
+    case op_concat:
+      --sp;
+      sp->s = store(string(sp->s) + string(sp[1].s));
+      break;
+
+    case op_num_cmp:
+      --sp;
+      sp->n = compareNum(sp->n, sp[1].n, i.arg);
+      break;
+
+    case op_str_cmp:
+      {
+	--sp;
+	const fix_string& a = sp[0].s;
+	const fix_string& b = sp[1].s;
+	size_t l = min(a.size(), b.size());
+	int r = (l? memcmp(a.data(), b.data(), l): 0);
+	if(!r && a.size() != b.size()) r = (a.size() < b.size()? -1: 1);
+	sp->n = compare(r, i.arg);
+      }
+      break;
+
+    case op_match:
+      sp->n = matches(i.arg, sp->s);
+      break;
+
+    case op_jump_false:
+      if(!sp->n) pc = i.arg - 1;
+      else --sp;
+      break;
+
+    case op_jump_true:
+      if(sp->n) pc = i.arg - 1;
+      else --sp;
+      break;
+
+    case op_abs:
+      sp->n = fabs(sp->n);
+      break;
+
+    case op_int:
+      sp->n = (sp->n < 0? ceil(sp->n): floor(sp->n));
+      break;
+
+    case op_length:
+      sp->n = sp->s.size();
+      break;
+
+    case op_lc:
+    case op_uc:
+      {
+	string s = sp->s;
+	foreach(string, it, s)
+	  *it = (i.op == op_lc? tolower((unsigned char)*it): toupper((unsigned char)*it));
+	sp->s = store(s);
+      }
+      break;
+    }
+  }
+  return sp->n != 0;
+}
+
+
+// Filter chunks of rows of a mapped table concurrently, marking the rows to
+// keep. Each chunk gets its own evaluator.
+struct filter_job: public parallel_job
+{
+  const fix_table& m;
+  const expr_program& prog;
+  size_t first;			// first chunk of the wave
+  vector<vector<char> >& keep;
+
+  filter_job(const fix_table& m, const expr_program& prog,
+      vector<vector<char> >& keep)
+  : m(m), prog(prog), first(0), keep(keep)
+  {}
+
+  void
+  operator()(size_t i)
+  {
+    size_t y0 = 1 + (first + i) * chunkRows;
+    size_t y1 = min(y0 + chunkRows, m.rows());
+    vector<char>& k = keep[i];
+    k.resize(y1 - y0);
+    expr_eval eval(prog);
+    for(size_t y = y0; y != y1; ++y)
+      k[y - y0] = eval(m[y]);
+  }
+};
+
+
+// the original line of row y, without the line terminator
+fix_string
+rowLine(const fix_table& m, size_t y)
+{
+  const char* s = m.cell(y, 0).data();
+  fix_string last = m.cell(y, m.cols() - 1);
+  return fix_string(s, last.data() + last.size() - s);
+}
+
+
+void
+filterMapped(fix_writer& out, const fix_table& m, const expr_program& prog)
+{
+  out.putMapped(rowLine(m, 0));
+  out << '\n';
+
+  // filter the chunks in parallel waves, writing back in order
+  stats_phase phase("filter");
+  size_t chunks = (m.rows() - 1 + chunkRows - 1) / chunkRows;
+  size_t wave = tblThreads() * chunksPerThread;
+  vector<vector<char> > keep(wave);
+  filter_job job(m, prog, keep);
+  for(; job.first < chunks; job.first += wave)
+  {
+    size_t n = min(wave, chunks - job.first);
+    parallelRun(job, n);
+    for(size_t i = 0; i != n; ++i)
+    {
+      size_t y0 = 1 + (job.first + i) * chunkRows;
+      for(size_t y = 0; y != keep[i].size(); ++y)
+      {
+	if(!keep[i][y]) continue;
+	out.putMapped(rowLine(m, y0 + y));
+	out << '\n';
+      }
+    }
+  }
+}
+
+
+void
+writeRow(fix_writer& out, const vector<fix_string>& row, const char sep)
+{
+  foreach_ro(vector<fix_string>, it, row)
+  {
+    if(it != row.begin()) out << sep;
+    out << *it;
+  }
+  out << '\n';
+}
+
+
+int
+main(int argc, char* argv[]) try
+{
+  const char* expr = NULL;
+  bool stats = false;
+
+  int arg;
+  while((arg = getopt(argc, argv, "he:S")) != -1)
+    switch(arg)
+    {
+    case 'h':
+      help(argv);
+      return EXIT_SUCCESS;
+
+    case 'e':
+      expr = optarg;
+      break;
+
+    case 'S':
+      stats = true;
+      break;
+
+    default:
+      return EXIT_FAILURE;
+    }
+
+  // check args
+  argc -= optind;
+  const char* file(argv[optind++]);
+  if(argc != 1 || !expr)
+  {
+    help(argv);
+    return EXIT_FAILURE;
+  }
+
+  // get default separator
+  char sep = '\t';
+  const char *envSep = getenv("TBLSEP");
+  if(envSep && *envSep)
+    sep = *envSep;
+
+  // open the file
+  statsInit("tblfilter2", stats);
+  int fd = openInput(file);
+  fix_writer out(STDOUT_FILENO, "stdout", tblThreads() > 1);
+  expr_program prog;
+  col_map labels;
+  if(isMappable(fd))
+  {
+    const char* addr;
+    fix_table& m = *mapFixTable(&addr, fd, file, sep);
+    if(m.rows())
+    {
+      for(size_t i = 0; i != m.cols(); ++i)
+	labels[m.cell(0, i)] = i;
+      expr_compiler(expr, prog, labels, m.cols(), file).compile();
+      filterMapped(out, m, prog);
+    }
+  }
+  else
+  {
+    // stream pipes one row at a time
+    stats_phase phase("stream");
+    fix_row_reader in(fd, file, sep);
+    vector<fix_string> row;
+    if(in.next(row))
+    {
+      for(size_t i = 0; i != row.size(); ++i)
+	labels[row[i]] = i;
+      expr_compiler(expr, prog, labels, row.size(), file).compile();
+      writeRow(out, row, sep);
+
+      expr_eval eval(prog);
+      while(in.next(row))
+	if(eval(row)) writeRow(out, row, sep);
+    }
+  }
+  stats_phase phase("flush");
+  out.close();
+}
+catch(runtime_error& e)
+{
+  cerr << e.what() << std::endl;
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,125 @@
+/*
+ * tblindex: build sidecar indexes for tables - implementation
+ * Copyright(c) 2010 EURAC, Institute of Genetic Medicine
+ */
+
+/*
+ * Headers
+ */
+
+// local headers
+#include "shared.hh"
+
+// system headers
+#include <memory>
+using std::auto_ptr;
+
+// c headers
+#include <stdlib.h>
+#include <unistd.h>
+
+
+/*
+ * Implementation
+ */
+
+void
+help(char* argv[])
+{
+  cerr << argv[0] << ": bad parameters:\n"
+       << "Usage: " << argv[0] << " [-hv] [-d sep] file [file ...]\n"
+       << "Build the \"file.tblidx\" sidecar index of each CSV file. tblcut, tbltransp2\n"
+       << "and tblmerge2 use a valid index to skip parsing the file entirely. An index\n"
+       << "is ignored as soon as the size or modification time of the file changes.\n"
+       << "You can change the column separator by setting the TBLSEP environment\n"
+       << "variable. The same separator must be used when reading the file.\n"
+       << "\n"
+       << "  -d sep:	set a different column separator\n"
+       << "  -v:	increase verbosity\n"
+       << "  -S:	print statistics at exit (see TBLSTATS)\n"
+       << "  -h:	help summary\n";
+}
+
+
+int
+main(int argc, char* argv[]) try
+{
+  int verb = 0;
+  char sep = 0;
+  bool stats = false;
+
+  int arg;
+  while((arg = getopt(argc, argv, "hvd:S")) != -1)
+    switch(arg)
+    {
+    case 'h':
+      help(argv);
+      return EXIT_SUCCESS;
+
+    case 'v':
+      ++verb;
+      break;
+
+    case 'd':
+      sep = *optarg;
+      break;
+
+    case 'S':
+      stats = true;
+      break;
+
+    default:
+      return EXIT_FAILURE;
+    }
+
+  // check args
+  argc -= optind;
+  if(argc < 1)
+  {
+    help(argv);
+    return EXIT_FAILURE;
+  }
+
+  // get default separator
+  if(!sep)
+  {
+    const char *envSep = getenv("TBLSEP");
+    if(envSep && *envSep) sep = *envSep;
+    else sep = '\t';
+  }
+
+  statsInit("tblindex", stats);
+  for(; argv[optind]; ++optind)
+  {
+    const char* file(argv[optind]);
+    if(!strcmp(file, "-"))
+      throw runtime_error("-: error: cannot index the standard input!");
+    if(verb > 0) cerr << "indexing " << file << "...\n";
+
+    int fd = openInput(file);
+    if(!isMappable(fd))
+      throw runtime_error(sprintf2("%s: error: not a regular file!", file));
+
+    size_t len;
+    stats_phase phase("load");
+    const char* addr = loadInput(fd, file, &len);
+    phase.end();
+
+    // always re-parse, ignoring any existing index
+    stats_phase parsePhase("parse");
+    auto_ptr<fix_table> t(parseFixTable(addr, len, file, sep));
+    parsePhase.end();
+
+    stats_phase writePhase("write");
+    writeFixTableIndex(*t, fd, file, sep);
+    writePhase.end();
+    t.reset();
+    unloadInput(addr, len);
+    close(fd);
+  }
+}
+catch(runtime_error& e)
+{
+  cerr << e.what() << std::endl;
+  return EXIT_FAILURE;
+}
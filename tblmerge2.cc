@@ -15,164 +15,2306 @@
 using std::map;
 using std::make_pair;
 
+#include <memory>
+using std::auto_ptr;
+
+#include <algorithm>
+using std::min;
+using std::max;
+using std::sort;
+
 // c headers
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/stat.h>
+
+
+/*
+ * Types and constants
+ */
+
+typedef map<string, size_t> col_map;
+typedef vector<size_t> key_col;
+
+// memory used by the in-memory merge, relative to the size of the input
+const size_t spillOverhead = 6;
+
+// maximum number of partitions of the out-of-core merge (at each level)
+const size_t spillPartsMax = 256;
+
+// smallest budget of a partition merged concurrently with others
+const size_t spillMergeMin = 1 << 24;
+
+// bounds of the I/O buffers of each partition
+const size_t spillBufferMin = 1 << 12;
+const size_t spillBufferMax = 1 << 20;
+
+// size of the blocks holding transformed cells
+const size_t poolBlockSize = 1 << 16;
+
+
+// order of the output rows
+enum key_order
+{
+  order_none,		// first seen
+  order_bytes,		// key cells in byte order
+  order_natural,	// runs of digits compared by value
+  order_numeric		// other cells in byte order, then numbers by value
+};
+
+
+// a key cell, prepared for sorting
+struct key_cell
+{
+  fix_string s;
+  double v;
+  bool num;		// numeric order only: 's' is a number of value 'v'
+
+  key_cell()
+  : s(NULL, 0), v(0), num(false)
+  {}
+};
+
+
+// merge behavior
+struct merge_opts
+{
+  bool keep_going;	// report conflicts and duplicates without stopping
+  bool common;		// output only the keys found in all inputs
+  int ref;		// input winning conflicts (1: earlier, 2: later, 0: none)
+  bool strip;		// strip spaces around cells
+  bool numbers;		// normalize numbers
+  key_order order;	// output order
+};
+
+
+// Cell transformations requested on input (strip, numbers). Transformed cells
+// which are not part of the original cell are stored in blocks owned by the
+// filter, which must outlive them.
+class cell_filter
+{
+  bool strip;
+  bool numbers;
+  vector<char*> blocks;
+  vector<char*> large;		// cells larger than a block
+  size_t block;			// current block
+  size_t used;			// bytes used in the current block
+  string buf;
+
+  fix_string
+  store(const char* p, size_t n);
+
+  fix_string
+  normNumber(const fix_string& c);
+
+  fix_string
+  apply(const fix_string& c);
+
+public:
+  explicit
+  cell_filter(bool strip = false, bool numbers = false)
+  : strip(strip), numbers(numbers), block(0), used(0)
+  {}
+
+  // copies share the options only
+  cell_filter(const cell_filter& r)
+  : strip(r.strip), numbers(r.numbers), block(0), used(0)
+  {}
+
+  cell_filter&
+  operator=(const cell_filter& r)
+  {
+    strip = r.strip;
+    numbers = r.numbers;
+    return *this;
+  }
+
+  ~cell_filter();
+
+  fix_string
+  operator()(const fix_string& c)
+  { return (strip || numbers? apply(c): c); }
+
+  // reuse the blocks, invalidating all the cells transformed so far
+  void
+  clear();
+};
+
+
+// Open-addressing hash index from a key (a fixed number of cells) to a row.
+// The key cells are kept as fix_string views of the mapped tables and are
+// compared in place, so that no key is ever copied.
+class key_map
+{
+  size_t width;
+  vector<fix_string> keys;	// 'width' key cells for each entry
+  vector<uint64_t> hashes;	// hash of each entry
+  vector<size_t> values;	// value of each entry
+  vector<size_t> slots;		// entry + 1 for each slot (0: free)
+
+  bool
+  equal(size_t e, const fix_string* k) const
+  {
+    const fix_string* ek = &keys[e * width];
+    for(size_t i = 0; i != width; ++i)
+      if(ek[i] != k[i]) return false;
+    return true;
+  }
+
+  size_t
+  probe(uint64_t h, const fix_string* k) const;
+
+  // rehash into at least n slots
+  void
+  grow(size_t n);
+
+public:
+  explicit
+  key_map(size_t width = 0)
+  : width(width)
+  {}
+
+  static uint64_t
+  hash(const fix_string* k, size_t width);
+
+  size_t
+  size() const
+  { return values.size(); }
+
+  // value of key 'k', or NULL when missing
+  size_t*
+  find(const fix_string* k);
+
+  // value of key 'k', inserting 'v' when missing
+  size_t&
+  insert(const fix_string* k, size_t v, bool& inserted)
+  { return insert(k, hash(k, width), v, inserted); }
+
+  // as above, with the hash of 'k' already known
+  size_t&
+  insert(const fix_string* k, uint64_t h, size_t v, bool& inserted);
+
+  // prepare for n entries overall
+  void
+  reserve(size_t n);
+
+  // entries, in insertion order
+  const fix_string*
+  key(size_t e) const
+  { return &keys[e * width]; }
+
+  uint64_t
+  keyHash(size_t e) const
+  { return hashes[e]; }
+
+  size_t
+  value(size_t e) const
+  { return values[e]; }
+
+  void
+  swap(key_map& r);
+};
+
+
+struct merge_input;
+
+
+// Merge destination, stored as column segments: the columns of the first
+// table, followed by the new columns brought by each merged table. Adding
+// columns never touches the existing rows: rows are only assembled at output.
+// The first segment is dense, while the others only store the rows that were
+// actually written, within the range of rows touched by their table.
+class merge_table
+{
+  struct segment
+  {
+    size_t width;
+    size_t lo;			// first row of the range
+    vector<size_t> slot;	// segment row + 1 of each row in range (0: empty),
+				// or no range at all for dense segments
+    vector<fix_string> cells;	// row-major
+
+    segment(size_t width, size_t lo, size_t hi)
+    : width(width), lo(lo), slot(hi - lo, 0)
+    {}
+  };
+
+  vector<fix_string> header;
+  vector<segment> segs;
+  vector<size_t> colSeg;	// segment of each column
+  vector<size_t> colOff;	// offset of each column in its segment
+  size_t rows_;
+
+  // cells of row y in segment s, or NULL when missing
+  const fix_string*
+  find(const segment& s, size_t y) const;
+
+  // extend the row range of segment s to include row y
+  static void
+  widen(segment& s, size_t y);
+
+public:
+  explicit
+  merge_table(merge_input& in);
+
+  size_t
+  rows() const
+  { return rows_; }
+
+  size_t
+  cols() const
+  { return header.size(); }
+
+  // append an empty row, returning its index
+  size_t
+  addRow()
+  { return rows_++; }
+
+  // start a new segment for the columns added next, expecting them to be
+  // written mostly within rows lo to hi (excluded)
+  void
+  addSegment(size_t lo, size_t hi)
+  { segs.push_back(segment(0, lo, hi)); }
+
+  // append a column to the last segment, returning its index
+  size_t
+  addColumn(const fix_string& label);
+
+  // segment of column x: the columns of each segment are contiguous
+  size_t
+  segmentOf(size_t x) const
+  { return colSeg[x]; }
+
+  // allocate the first (dense) segment for all the rows, so that its columns
+  // can then be written concurrently
+  void
+  fillDense()
+  { segs[0].cells.resize((rows_ - 1) * segs[0].width, fix_string(NULL, 0)); }
+
+  fix_string&
+  cell(size_t y, size_t x)
+  {
+    segment& s = segs[colSeg[x]];
+    size_t r;
+    if(s.slot.empty())
+    {
+      // dense segment
+      r = y - 1;
+      if((r + 1) * s.width > s.cells.size())
+	s.cells.resize((r + 1) * s.width, fix_string(NULL, 0));
+    }
+    else
+    {
+      if(y < s.lo || y - s.lo >= s.slot.size()) widen(s, y);
+      size_t& sl = s.slot[y - s.lo];
+      if(!sl)
+      {
+	sl = s.cells.size() / s.width + 1;
+	s.cells.resize(s.cells.size() + s.width, fix_string(NULL, 0));
+      }
+      r = sl - 1;
+    }
+    return s.cells[r * s.width + colOff[x]];
+  }
+
+  // cell at row y, column x (empty when never written)
+  fix_string
+  at(size_t y, size_t x) const
+  {
+    const fix_string* c = find(segs[colSeg[x]], y);
+    return (c? c[colOff[x]]: fix_string(NULL, 0));
+  }
+
+  // assemble and write out row y
+  void
+  write(fix_writer& out, size_t y, const char sep) const;
+};
+
+
+/*
+ * Implementation
+ */
+
+void
+help(char* argv[])
+{
+  cerr << argv[0] << ": bad parameters:\n"
+       << "Usage: " << argv[0] << " [-hvksc12itn] [-j N] [-m MB] [-o ORDER] key file1 file2 [file3 ...]\n"
+       << "Perform a full join on 'key' of two or more CSV files, performing a\n"
+       << "comparison of common columns. 'key' can be a comma-separated list of\n"
+       << "column names to form unique indexes. CSV files are TAB separated,\n"
+       << "containing column labels on the first row. You can change the column\n"
+       << "separator by setting the TBLSEP environment variable.\n"
+       << "\n"
+       << "  -v:	increase verbosity\n"
+       << "  -k:	keep going on duplicate rows\n"
+       << "  -c:	output only the keys common to all files (inner join)\n"
+       << "  -1:	resolve conflicts using the earlier file\n"
+       << "  -2:	resolve conflicts using the later file\n"
+       << "  -i:	ignore empty cells in comparisons (always the case)\n"
+       << "  -t:	strip spaces around cells\n"
+       << "  -n:	normalize numbers (\"007.50\" => \"7.5\")\n"
+       << "  -j N:	load and index up to N files at once (default: TBLTHREADS)\n"
+       << "  -s:	inputs are sorted by key: merge them in a single streaming pass\n"
+       << "  -m MB:	merge out-of-core, using about MB megabytes of memory\n"
+       << "  -o ORDER:	sort rows by key: bytes, natural (\"chr2\" < \"chr10\") or numeric\n"
+       << "  -S:	print statistics at exit (see TBLSTATS)\n"
+       << "  -h:	help summary\n";
+}
+
+
+uint64_t
+key_map::hash(const fix_string* k, size_t width)
+{
+  uint64_t h = width;
+  for(size_t i = 0; i != width; ++i)
+  {
+    const char* p = k[i].data();
+    size_t n = k[i].size();
+    h = (h ^ n) * 0x9E3779B97F4A7C15ULL;
+    for(; n >= 8; p += 8, n -= 8)
+    {
+      uint64_t w;
+      memcpy(&w, p, 8);
+      h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+      h ^= h >> 29;
+    }
+    if(n)
+    {
+      uint64_t w = 0;
+      memcpy(&w, p, n);
+      h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+      h ^= h >> 29;
+    }
+  }
+  return h ^ (h >> 32);
+}
+
+
+size_t
+key_map::probe(uint64_t h, const fix_string* k) const
+{
+  size_t mask = slots.size() - 1;
+  for(size_t i = h & mask;; i = (i + 1) & mask)
+  {
+    size_t e = slots[i];
+    if(!e || (hashes[e - 1] == h && equal(e - 1, k)))
+      return i;
+  }
+}
+
+
+void
+key_map::grow(size_t n)
+{
+  size_t size = (slots.size()? slots.size() * 2: 64);
+  while(size < n) size *= 2;
+  vector<size_t> tmp(size, 0);
+  slots.swap(tmp);
+  size_t mask = slots.size() - 1;
+  for(size_t e = 0; e != hashes.size(); ++e)
+  {
+    size_t i = hashes[e] & mask;
+    while(slots[i]) i = (i + 1) & mask;
+    slots[i] = e + 1;
+  }
+}
+
+
+size_t*
+key_map::find(const fix_string* k)
+{
+  if(!slots.size()) return NULL;
+  size_t e = slots[probe(hash(k, width), k)];
+  return (e? &values[e - 1]: NULL);
+}
+
+
+void
+key_map::reserve(size_t n)
+{
+  keys.reserve(n * width);
+  hashes.reserve(n);
+  values.reserve(n);
+  if(n * 2 > slots.size()) grow(n * 2);
+}
+
+
+size_t&
+key_map::insert(const fix_string* k, uint64_t h, size_t v, bool& inserted)
+{
+  // keep the load factor below 1/2
+  if((values.size() + 1) * 2 > slots.size()) grow(0);
+
+  size_t i = probe(h, k);
+  inserted = !slots[i];
+  if(inserted)
+  {
+    keys.insert(keys.end(), k, k + width);
+    hashes.push_back(h);
+    values.push_back(v);
+    slots[i] = values.size();
+  }
+  return values[slots[i] - 1];
+}
+
+
+void
+key_map::swap(key_map& r)
+{
+  std::swap(width, r.width);
+  keys.swap(r.keys);
+  hashes.swap(r.hashes);
+  values.swap(r.values);
+  slots.swap(r.slots);
+}
+
+
+cell_filter::~cell_filter()
+{
+  clear();
+  foreach(vector<char*>, it, blocks)
+    delete[] *it;
+}
+
+
+void
+cell_filter::clear()
+{
+  foreach(vector<char*>, it, large)
+    delete[] *it;
+  large.clear();
+  block = used = 0;
+}
+
+
+fix_string
+cell_filter::store(const char* p, size_t n)
+{
+  char* dst;
+  if(n > poolBlockSize)
+  {
+    dst = new char[n];
+    large.push_back(dst);
+  }
+  else
+  {
+    if(block != blocks.size() && used + n > poolBlockSize)
+    {
+      ++block;
+      used = 0;
+    }
+    if(block == blocks.size())
+      blocks.push_back(new char[poolBlockSize]);
+    dst = blocks[block] + used;
+    used += n;
+  }
+  memcpy(dst, p, n);
+  return fix_string(dst, n);
+}
+
+
+static inline bool
+isSpace(char c)
+{
+  return (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v');
+}
+
+
+static inline bool
+isDigit(char c)
+{
+  return (c >= '0' && c <= '9');
+}
+
+
+// Canonical form of numbers, as in tblmerge: "[+-] 007.50 %" => "+7.5%",
+// ".5" => "0.5", "-0.00" => "-0", "5.0" => "5". Other cells are unchanged.
+fix_string
+cell_filter::normNumber(const fix_string& c)
+{
+  const char* p = c.data();
+  const char* e = p + c.size();
+
+  // spaces, sign, spaces, digits, point, digits, spaces, percent, spaces
+  while(p != e && isSpace(*p)) ++p;
+  const char* sign = p;
+  if(p != e && (*p == '+' || *p == '-')) ++p;
+  size_t signLen = p - sign;
+  while(p != e && isSpace(*p)) ++p;
+  const char* ds = p;
+  while(p != e && isDigit(*p)) ++p;
+  if(p != e && *p == '.') ++p;
+  while(p != e && isDigit(*p)) ++p;
+  const char* de = p;
+  while(p != e && isSpace(*p)) ++p;
+  bool pct = (p != e && *p == '%');
+  if(pct) ++p;
+  while(p != e && isSpace(*p)) ++p;
+  if(p != e) return c;
+
+  // leading zeros
+  size_t z = 0;
+  while(ds + z != de && ds[z] == '0') ++z;
+  if(z && ds + z != de && ds[z] >= '1' && ds[z] <= '9') ds += z;
+
+  buf.assign(sign, signLen);
+  size_t n0 = buf.size();
+  if(ds != de && *ds == '.') buf += '0';
+  buf.append(ds, de - ds);
+
+  // all zeros: "0"
+  size_t dot = buf.find('.', n0);
+  bool zero = (buf.size() != n0 && buf[n0] == '0');
+  for(size_t i = n0; zero && i != buf.size(); ++i)
+    zero = (buf[i] == '0' || (i == dot && i != n0));
+  if(zero)
+    buf.resize(n0 + 1);
+  else if(dot != string::npos)
+  {
+    // trailing decimal zeros, then a trailing point
+    size_t end = buf.size();
+    while(end != dot + 1 && buf[end - 1] == '0') --end;
+    buf.resize(end == dot + 1? dot: end);
+  }
+  if(pct) buf += '%';
+
+  // reference the original cell when possible
+  if(buf.size() == c.size() && !memcmp(buf.data(), c.data(), c.size()))
+    return c;
+  const char* q = c.data();
+  const char* qe = q + c.size() - buf.size();
+  for(; buf.size() <= c.size() && q <= qe; ++q)
+    if(!memcmp(q, buf.data(), buf.size()))
+      return fix_string(q, buf.size());
+  return store(buf.data(), buf.size());
+}
+
+
+fix_string
+cell_filter::apply(const fix_string& c)
+{
+  fix_string r = c;
+  if(strip)
+  {
+    const char* p = r.data();
+    const char* e = p + r.size();
+    while(p != e && isSpace(*p)) ++p;
+    while(e != p && isSpace(*(e - 1))) --e;
+    r = fix_string(p, e - p);
+  }
+  if(numbers)
+    r = normNumber(r);
+  return r;
+}
+
+
+size_t
+merge_table::addColumn(const fix_string& label)
+{
+  // no cells are written in the segment so far
+  header.push_back(label);
+  colSeg.push_back(segs.size() - 1);
+  colOff.push_back(segs.back().width++);
+  return cols() - 1;
+}
+
+
+void
+merge_table::widen(segment& s, size_t y)
+{
+  // grow geometrically in either direction
+  size_t n = s.slot.size();
+  if(y >= s.lo)
+    s.slot.resize(max(y - s.lo + 1, n * 2), 0);
+  else
+  {
+    size_t lo = min(y, s.lo - min(s.lo, n));
+    s.slot.insert(s.slot.begin(), s.lo - lo, 0);
+    s.lo = lo;
+  }
+}
+
+
+const fix_string*
+merge_table::find(const segment& s, size_t y) const
+{
+  size_t r;
+  if(s.slot.empty())
+    r = y - 1;
+  else
+  {
+    if(y < s.lo || y - s.lo >= s.slot.size() || !s.slot[y - s.lo])
+      return NULL;
+    r = s.slot[y - s.lo] - 1;
+  }
+  r *= s.width;
+  return (r < s.cells.size()? &s.cells[r]: NULL);
+}
+
+
+void
+merge_table::write(fix_writer& out, size_t y, const char sep) const
+{
+  if(!y)
+  {
+    // labels
+    vector<fix_string>::const_iterator it = header.begin();
+    out.putMapped(*it);
+    for(++it; it != header.end(); ++it)
+    {
+      out << sep;
+      out.putMapped(*it);
+    }
+    out << '\n';
+    return;
+  }
+
+  foreach_ro(vector<segment>, it, segs)
+  {
+    const fix_string* c = find(*it, y);
+    for(size_t x = 0; x != it->width; ++x)
+    {
+      if(x || it != segs.begin()) out << sep;
+      if(c) out.putMapped(c[x]);
+    }
+  }
+  out << '\n';
+}
+
+
+// gather the key cells of a row
+template<class R>
+const fix_string*
+keyCells(vector<fix_string>& buf, const key_col& kc, const R& row)
+{
+  buf.clear();
+  foreach_ro(key_col, it, kc)
+    buf.push_back(row[*it]);
+  return &buf[0];
+}
+
+
+// key as a string, for messages
+template<class R>
+string
+buildKey(const key_col& kc, const R& row)
+{
+  key_col::const_iterator it = kc.begin();
+  string buf(row[*it]);
+  for(++it; it != kc.end(); ++it)
+  {
+    buf += '\0';
+    buf += row[*it];
+  }
+  return buf;
+}
+
+
+string
+unescape(const string& str, const char c = ',')
+{
+  string buf;
+  bool esc = false;
+  foreach_ro(string, p, str)
+  {
+    if(*p == '\\' && !esc)
+    {
+      esc = true;
+      continue;
+    }
+
+    if(*p == c && !esc)
+      buf += '\0';
+    else
+      buf += *p;
+
+    esc = false;
+  }
+  return buf;
+}
+
+
+string
+escape(const string& str, const char c = ',')
+{
+  string buf;
+  foreach_ro(string, it, str)
+  {
+    if(*it == '\0')
+      buf += c;
+    else if(*it != c)
+      buf += *it;
+    else
+    {
+      buf += '\\';
+      buf += c;
+    }
+  }
+  return buf;
+}
+
+
+// An input file, loaded and indexed ahead of its merge
+struct merge_input
+{
+  const char* file;
+  fix_table* t;
+  col_map cm;
+  key_col kc;
+  key_map km;
+  cell_filter filter;	// owns the transformed cells
+  vector<size_t> rowMap;	// row of the key index of each row
+  size_t rows;		// rows of the key index (see mergeTree)
+  string log;		// diagnostics, reported when the input is merged
+  bool failed;
+
+  merge_input()
+  : file(NULL), t(NULL), rows(0), failed(false)
+  {}
+
+  fix_string
+  cell(size_t y, size_t x)
+  { return filter(t->cell(y, x)); }
+};
+
+
+// a row of an input, with the cell transformations applied
+struct input_row
+{
+  merge_input& in;
+  size_t y;
+
+  input_row(merge_input& in, size_t y)
+  : in(in), y(y)
+  {}
+
+  fix_string
+  operator[](size_t x) const
+  { return in.cell(y, x); }
+};
+
+
+merge_table::merge_table(merge_input& in)
+: rows_(in.t->rows())
+{
+  const fix_table& t = *in.t;
+  segs.push_back(segment(t.cols(), 0, 0));
+  vector<fix_string>& cells = segs.back().cells;
+  cells.reserve((t.rows() - 1) * t.cols());
+  for(size_t y = 1; y != t.rows(); ++y)
+    for(size_t x = 0; x != t.cols(); ++x)
+      cells.push_back(in.cell(y, x));
+  for(size_t x = 0; x != t.cols(); ++x)
+  {
+    header.push_back(in.cell(0, x));
+    colSeg.push_back(0);
+    colOff.push_back(x);
+  }
+}
+
+
+// Destination of the in-memory merge
+struct merge_state
+{
+  auto_ptr<merge_table> m;
+  col_map cm;
+  key_map km;
+  key_col kc;
+  unsigned inputs;		// number of merged inputs
+  vector<unsigned> hits;	// number of inputs having each row
+  vector<unsigned> last;	// last input having each row
+  vector<cell_filter> filters;	// own the cells transformed by mergeTree
+
+  merge_state()
+  : inputs(0)
+  {}
+
+  // true when row y is part of the output
+  bool
+  wanted(size_t y, const merge_opts& opts) const
+  { return (!opts.common || !y || hits[y] == inputs); }
+};
+
+
+string
+conflictError(const string& cname, const string& key)
+{
+  return sprintf2("conflicting contents for column \"%s\", key \"%s\"",
+		  cname.c_str(), escape(key).c_str());
+}
+
+
+// Conflicting cells are reported and resolved according to the reference
+// input, or are fatal unless keeping going.
+void
+conflict(string& log, const string& cname, const string& key,
+    fix_string& dstCell, const fix_string& cell, const merge_opts& opts)
+{
+  string error = conflictError(cname, key);
+  if(!opts.keep_going && !opts.ref)
+    throw runtime_error(error.c_str());
+  log += error + '\n';
+  if(opts.ref == 2) dstCell = cell;
+}
+
+
+void
+mergeTable(merge_state& dst, merge_input& add, const merge_opts& opts)
+{
+  // key lookup, allocating the new rows
+  merge_table& m = *dst.m;
+  const size_t rows = add.t->rows();
+  const size_t cols = add.t->cols();
+  vector<size_t> dstRows(rows);
+  size_t lo = m.rows();
+  size_t hi = 0;
+  vector<fix_string> key;
+  for(size_t y = 1; y != rows; ++y)
+  {
+    bool inserted;
+    size_t dstY = dst.km.insert(keyCells(key, add.kc, input_row(add, y)), m.rows(), inserted);
+    if(inserted) m.addRow();
+    dstRows[y] = dstY;
+    lo = min(lo, dstY);
+    hi = max(hi, dstY + 1);
+  }
+
+  // count the inputs having each row
+  ++dst.inputs;
+  if(opts.common)
+  {
+    dst.hits.resize(m.rows(), 0);
+    dst.last.resize(m.rows(), 0);
+    for(size_t y = 1; y != rows; ++y)
+    {
+      size_t dstY = dstRows[y];
+      if(dst.last[dstY] == dst.inputs) continue;
+      dst.last[dstY] = dst.inputs;
+      ++dst.hits[dstY];
+    }
+  }
+
+  // preallocate all columns on dst, in a new segment
+  vector<size_t> addDstCm;
+  bool segment = false;
+
+  for(size_t x = 0; x != cols; ++x)
+  {
+    fix_string label = add.cell(0, x);
+    string cname = label;
+    col_map::iterator dIt = dst.cm.find(cname);
+    if(dIt != dst.cm.end())
+      addDstCm.push_back(dIt->second);
+    else
+    {
+      // allocate a new (empty) column
+      if(!segment)
+      {
+	m.addSegment(lo, max(lo, hi));
+	segment = true;
+      }
+      size_t ki = m.addColumn(label);
+      addDstCm.push_back(ki);
+      dst.cm.insert(make_pair(cname, ki));
+    }
+  }
+
+  // iterate on add rows
+  for(size_t y = 1; y != rows; ++y)
+  {
+    // merge row
+    size_t dstY = dstRows[y];
+    for(size_t addCol = 0; addCol != cols; ++addCol)
+    {
+      fix_string cell = add.cell(y, addCol);
+      if(!cell.size()) continue;
+
+      fix_string& dstCell = m.cell(dstY, addDstCm[addCol]);
+      if(!dstCell.size())
+	dstCell = cell;
+      else if(cell != dstCell)
+      {
+	conflict(add.log, add.cell(0, addCol), buildKey(add.kc, input_row(add, y)),
+	    dstCell, cell, opts);
+      }
+    }
+  }
+}
+
+
+// Build the column and key maps of the table 't', which is owned by the
+// input from now on. Diagnostics are collected in the input log, so that they
+// are reported in command-line order. Returns false when the merge cannot
+// continue.
+bool
+indexInput(merge_input& in, fix_table* t, const vector<string>& keys,
+    const merge_opts& opts)
+{
+  in.t = t;
+  in.filter = cell_filter(opts.strip, opts.numbers);
+  if(!t->rows() || !t->cols())
+  {
+    in.log += sprintf2("%s: file is empty\n", in.file);
+    return false;
+  }
+
+  // build the column map
+  stats_phase phase("columns");
+  for(size_t i = 0; i != t->cols(); ++i)
+  {
+    const string cname = in.cell(0, i);
+    if(!in.cm.insert(make_pair(cname, i)).second)
+    {
+      in.log += sprintf2("%s: duplicated column \"%s\"\n", in.file, cname.c_str());
+      return false;
+    }
+  }
+
+  foreach_ro(vector<string>, keyIt, keys)
+  {
+    col_map::const_iterator ci = in.cm.find(*keyIt);
+    if(ci == in.cm.end())
+    {
+      in.log += sprintf2("%s: cannot find key column \"%s\"\n", in.file, keyIt->c_str());
+      if(!opts.keep_going) return false;
+    }
+    in.kc.push_back(ci->second);
+  }
+
+  // build the key map
+  phase.end();
+  stats_phase keysPhase("keys");
+  key_map(in.kc.size()).swap(in.km);
+  in.rows = t->rows();
+  in.rowMap.resize(in.rows, 0);
+  vector<fix_string> key;
+  for(size_t i = 1; i != t->rows(); ++i)
+  {
+    bool inserted;
+    in.rowMap[i] = in.km.insert(keyCells(key, in.kc, input_row(in, i)), i, inserted);
+    if(!inserted)
+    {
+      in.log += sprintf2("%s: duplicated key \"%s\"\n", in.file,
+	  escape(buildKey(in.kc, input_row(in, i))).c_str());
+      if(!opts.keep_going) return false;
+    }
+  }
+
+  return true;
+}
+
+
+// map and index an input
+bool
+prepareInput(merge_input& in, const vector<string>& keys, const char sep,
+    const merge_opts& opts, int verb, unsigned threads)
+{
+  if(verb > 0) in.log += sprintf2("loading %s...\n", in.file);
+  const char* addr;
+  return indexInput(in, mapFixTable(&addr, in.file, sep, NULL, threads, &in.log),
+      keys, opts);
+}
+
+
+// Fold an indexed input into the destination (set up by the first input).
+// Reported conflicts are added to the input log.
+void
+mergeInput(merge_state& dst, merge_input& in, const merge_opts& opts)
+{
+  stats_phase phase("merge");
+  if(dst.m.get())
+  {
+    // table merge on the working copy
+    try { mergeTable(dst, in, opts); }
+    catch(const runtime_error& e)
+    { throw runtime_error(sprintf2("%s: %s", in.file, e.what())); }
+    key_map().swap(in.km);
+  }
+  else
+  {
+    // setup the destination table
+    dst.m.reset(new merge_table(in));
+    dst.cm.swap(in.cm);
+    dst.km.swap(in.km);
+    dst.kc.swap(in.kc);
+    dst.inputs = 1;
+    if(opts.common)
+    {
+      dst.hits.assign(dst.m->rows(), 1);
+      dst.last.assign(dst.m->rows(), 1);
+    }
+  }
+}
+
+
+// compare digit runs by value, anything else by byte
+int
+compareNatural(const fix_string& a, const fix_string& b)
+{
+  const char* p = a.data();
+  const char* pe = p + a.size();
+  const char* q = b.data();
+  const char* qe = q + b.size();
+  while(p != pe && q != qe)
+  {
+    if(isDigit(*p) && isDigit(*q))
+    {
+      while(p != pe && *p == '0') ++p;
+      while(q != qe && *q == '0') ++q;
+      const char* ps = p;
+      const char* qs = q;
+      while(p != pe && isDigit(*p)) ++p;
+      while(q != qe && isDigit(*q)) ++q;
+      if(p - ps != q - qs) return (p - ps < q - qs? -1: 1);
+      int r = memcmp(ps, qs, p - ps);
+      if(r) return r;
+      continue;
+    }
+    if(*p != *q) return ((unsigned char)*p < (unsigned char)*q? -1: 1);
+    ++p;
+    ++q;
+  }
+  if(p != pe) return 1;
+  if(q != qe) return -1;
+  return 0;
+}
+
+
+int
+compareBytes(const fix_string& a, const fix_string& b)
+{
+  size_t n = min(a.size(), b.size());
+  int r = (n? memcmp(a.data(), b.data(), n): 0);
+  if(r || a.size() == b.size()) return r;
+  return (a.size() < b.size()? -1: 1);
+}
+
+
+void
+prepareKey(key_cell& k, const fix_string& c, key_order order)
+{
+  k.s = c;
+  k.num = false;
+  if(order != order_numeric || !c.size()) return;
+
+  char buf[64];
+  if(c.size() >= sizeof(buf)) return;
+  memcpy(buf, c.data(), c.size());
+  buf[c.size()] = 0;
+  char* end;
+  k.v = strtod(buf, &end);
+  k.num = (end == buf + c.size() && k.v == k.v);
+}
+
+
+// Compare two prepared keys. Keys which are equal in the requested order
+// fall back to byte order, so that only identical keys compare equal.
+int
+compareOrder(const key_cell* a, const key_cell* b, size_t width,
+    key_order order)
+{
+  for(size_t i = 0; i != width; ++i)
+  {
+    int r = 0;
+    if(order == order_natural)
+      r = compareNatural(a[i].s, b[i].s);
+    else if(order == order_numeric && (a[i].num || b[i].num))
+    {
+      if(a[i].num != b[i].num) r = (a[i].num? 1: -1);
+      else if(a[i].v != b[i].v) r = (a[i].v < b[i].v? -1: 1);
+    }
+    if(!r) r = compareBytes(a[i].s, b[i].s);
+    if(r) return r;
+  }
+  return 0;
+}
+
+
+// row comparison, by key
+struct row_less
+{
+  const vector<key_cell>& keys;	// 'width' key cells for each row
+  const size_t width;
+  const key_order order;
+
+  row_less(const vector<key_cell>& keys, size_t width, key_order order)
+  : keys(keys), width(width), order(order)
+  {}
+
+  bool
+  operator()(size_t a, size_t b) const
+  { return compareOrder(&keys[a * width], &keys[b * width], width, order) < 0; }
+};
+
+
+// Stable parallel merge sort: chunks are sorted concurrently, then merged
+// pairwise, also concurrently.
+struct sort_job: public parallel_job
+{
+  vector<size_t>& rows;
+  vector<size_t> tmp;
+  const row_less& less;
+  vector<size_t> bounds;	// chunks, plus the end
+  size_t stride;		// 0: sort the chunks
+
+  sort_job(vector<size_t>& rows, const row_less& less)
+  : rows(rows), tmp(rows.size()), less(less), stride(0)
+  {}
+
+  void
+  operator()(size_t i)
+  {
+    if(!stride)
+    {
+      std::stable_sort(rows.begin() + bounds[i], rows.begin() + bounds[i + 1], less);
+      return;
+    }
+    size_t a = i * stride * 2;
+    size_t b = min(a + stride, bounds.size() - 1);
+    size_t e = min(b + stride, bounds.size() - 1);
+    std::merge(rows.begin() + bounds[a], rows.begin() + bounds[b],
+	rows.begin() + bounds[b], rows.begin() + bounds[e],
+	tmp.begin() + bounds[a], less);
+  }
+
+  void
+  run(unsigned threads)
+  {
+    if(!threads) threads = tblThreads();
+    size_t chunks = min<size_t>(threads * 4, max<size_t>(1, rows.size() >> 12));
+    for(size_t i = 0; i != chunks; ++i)
+      bounds.push_back(rows.size() * i / chunks);
+    bounds.push_back(rows.size());
+    parallelRun(*this, chunks, threads);
+    for(stride = 1; stride < chunks; stride *= 2)
+    {
+      parallelRun(*this, (chunks + stride * 2 - 1) / (stride * 2), threads);
+      rows.swap(tmp);
+    }
+  }
+};
+
+
+// write out the merged rows, in key order if requested (sorting on up to
+// 'threads' threads)
+void
+writeMerged(fix_writer& out, const merge_state& dst, const merge_opts& opts,
+    const char sep, bool header = true, unsigned threads = 0)
+{
+  const merge_table& m = *dst.m;
+  if(opts.order == order_none)
+  {
+    for(size_t y = (header? 0: 1); y != m.rows(); ++y)
+      if(dst.wanted(y, opts)) m.write(out, y, sep);
+    return;
+  }
+
+  stats_phase phase("sort");
+  const size_t width = dst.kc.size();
+  vector<key_cell> keys(m.rows() * width);
+  vector<size_t> rows;
+  for(size_t y = 1; y != m.rows(); ++y)
+  {
+    if(!dst.wanted(y, opts)) continue;
+    rows.push_back(y);
+    for(size_t i = 0; i != width; ++i)
+      prepareKey(keys[y * width + i], m.at(y, dst.kc[i]), opts.order);
+  }
+  row_less less(keys, width, opts.order);
+  sort_job(rows, less).run(threads);
+  phase.end();
+
+  if(header) m.write(out, 0, sep);
+  foreach_ro(vector<size_t>, it, rows)
+    m.write(out, *it, sep);
+}
+
+
+// prepare a batch of inputs concurrently
+struct load_job: public parallel_job
+{
+  vector<merge_input>& inputs;
+  const vector<string>& keys;
+  const char sep;
+  const merge_opts& opts;
+  const int verb;
+  size_t first;
+  size_t n;
+  unsigned threads;
+
+  load_job(vector<merge_input>& inputs, const vector<string>& keys,
+      const char sep, const merge_opts& opts, int verb)
+  : inputs(inputs), keys(keys), sep(sep), opts(opts), verb(verb),
+    first(0), n(0), threads(0)
+  {}
+
+  void
+  operator()(size_t i)
+  {
+    merge_input& in = inputs[first + i];
+    try { in.failed = !prepareInput(in, keys, sep, opts, verb, threads); }
+    catch(const runtime_error& e)
+    {
+      in.log += e.what();
+      in.log += '\n';
+      in.failed = true;
+    }
+  }
+};
+
+
+// Merge the key index of the subtree of inputs b to e (excluded) into the
+// index of the subtree starting at a. The rows of the merged subtree are
+// those of a, followed by the new keys of b in order: the same order as a
+// merge done one input at a time. Row maps of the inputs of b are updated.
+void
+mergeKeys(vector<merge_input>& inputs, size_t a, size_t b, size_t e)
+{
+  key_map& dst = inputs[a].km;
+  key_map& add = inputs[b].km;
+  size_t& rows = inputs[a].rows;
+  vector<size_t> remap(inputs[b].rows, 0);
+  dst.reserve(dst.size() + add.size());
+  for(size_t i = 0; i != add.size(); ++i)
+  {
+    bool inserted;
+    remap[add.value(i)] = dst.insert(add.key(i), add.keyHash(i), rows, inserted);
+    if(inserted) ++rows;
+  }
+  key_map().swap(add);
+
+  for(size_t i = b; i != e; ++i)
+    foreach(vector<size_t>, it, inputs[i].rowMap)
+      *it = remap[*it];
+}
+
+
+// merge pairs of subtrees 'stride' inputs apart
+struct tree_job: public parallel_job
+{
+  vector<merge_input>& inputs;
+  const size_t n;
+  size_t stride;
+
+  tree_job(vector<merge_input>& inputs, size_t n)
+  : inputs(inputs), n(n), stride(1)
+  {}
+
+  void
+  operator()(size_t p)
+  {
+    size_t a = p * stride * 2;
+    size_t b = a + stride;
+    mergeKeys(inputs, a, b, min(b + stride, n));
+  }
+};
+
+
+// a conflicting cell, located on its input
+struct merge_conflict
+{
+  size_t input;
+  size_t y;
+  size_t x;
+
+  merge_conflict(size_t input, size_t y, size_t x)
+  : input(input), y(y), x(x)
+  {}
+
+  // order of a merge done one input at a time
+  bool
+  operator<(const merge_conflict& r) const
+  {
+    if(input != r.input) return input < r.input;
+    if(y != r.y) return y < r.y;
+    return x < r.x;
+  }
+};
+
+
+// Merge the cells of a range of destination columns, for all the inputs in
+// order. Each task owns whole sparse segments or part of the dense one, so
+// that tasks never write the same segment rows. Conflicting cells are
+// collected; the first one ends the task when conflicts are fatal.
+struct cell_job: public parallel_job
+{
+  struct task
+  {
+    size_t lo, hi;		// destination columns
+    cell_filter* filter;	// owns the cells transformed by the task
+    vector<merge_conflict> conflicts;
+  };
+
+  merge_table& m;
+  vector<merge_input>& inputs;
+  const size_t n;
+  const vector<vector<size_t> >& dstCols;	// of each input column
+  const merge_opts& opts;
+  vector<task> tasks;
+
+  cell_job(merge_table& m, vector<merge_input>& inputs, size_t n,
+      const vector<vector<size_t> >& dstCols, const merge_opts& opts)
+  : m(m), inputs(inputs), n(n), dstCols(dstCols), opts(opts)
+  {}
+
+  void
+  operator()(size_t t);
+};
+
+
+void
+cell_job::operator()(size_t t)
+{
+  task& tk = tasks[t];
+  vector<size_t> cols;
+  for(size_t i = 1; i != n; ++i)
+  {
+    const merge_input& in = inputs[i];
+    const vector<size_t>& dc = dstCols[i];
+    cols.clear();
+    for(size_t x = 0; x != dc.size(); ++x)
+      if(dc[x] >= tk.lo && dc[x] < tk.hi) cols.push_back(x);
+    if(!cols.size()) continue;
+
+    for(size_t y = 1; y != in.t->rows(); ++y)
+    {
+      size_t dstY = in.rowMap[y];
+      foreach_ro(vector<size_t>, it, cols)
+      {
+	fix_string cell = (*tk.filter)(in.t->cell(y, *it));
+	if(!cell.size()) continue;
+
+	fix_string& dstCell = m.cell(dstY, dc[*it]);
+	if(!dstCell.size())
+	  dstCell = cell;
+	else if(cell != dstCell)
+	{
+	  tk.conflicts.push_back(merge_conflict(i, y, *it));
+	  if(!opts.keep_going && !opts.ref) return;
+	  if(opts.ref == 2) dstCell = cell;
+	}
+      }
+    }
+  }
+}
+
+
+// Merge the first n indexed inputs into dst, with the same result as merging
+// them one at a time with mergeInput. The key indexes are merged pairwise in
+// a balanced tree, then the cells are merged by ranges of columns, both
+// concurrently. Logs and conflicts are reported in command-line order.
+void
+mergeTree(merge_state& dst, vector<merge_input>& inputs, size_t n,
+    const merge_opts& opts, int verb)
+{
+  stats_phase phase("merge");
+  tree_job tree(inputs, n);
+  for(; tree.stride < n; tree.stride *= 2)
+    parallelRun(tree, (n - tree.stride + tree.stride * 2 - 1) / (tree.stride * 2));
+
+  // rows and columns of the destination
+  merge_input& first = inputs[0];
+  dst.m.reset(new merge_table(first));
+  merge_table& m = *dst.m;
+  while(m.rows() != first.rows) m.addRow();
+  key_map().swap(first.km);
+  dst.cm.swap(first.cm);
+  dst.kc.swap(first.kc);
+
+  vector<vector<size_t> > dstCols(n);
+  for(size_t i = 1; i != n; ++i)
+  {
+    merge_input& in = inputs[i];
+    size_t lo = m.rows();
+    size_t hi = 0;
+    for(size_t y = 1; y != in.rowMap.size(); ++y)
+    {
+      lo = min(lo, in.rowMap[y]);
+      hi = max(hi, in.rowMap[y] + 1);
+    }
+
+    bool segment = false;
+    for(size_t x = 0; x != in.t->cols(); ++x)
+    {
+      fix_string label = in.cell(0, x);
+      string cname = label;
+      col_map::iterator dIt = dst.cm.find(cname);
+      if(dIt != dst.cm.end())
+	dstCols[i].push_back(dIt->second);
+      else
+      {
+	if(!segment)
+	{
+	  m.addSegment(lo, max(lo, hi));
+	  segment = true;
+	}
+	size_t ki = m.addColumn(label);
+	dstCols[i].push_back(ki);
+	dst.cm.insert(make_pair(cname, ki));
+      }
+    }
+  }
+
+  // split the dense segment among the threads, one task per other segment
+  m.fillDense();
+  cell_job job(m, inputs, n, dstCols, opts);
+  size_t dense = 0;
+  while(dense != m.cols() && !m.segmentOf(dense)) ++dense;
+  size_t step = max<size_t>(1, (dense + tblThreads() - 1) / tblThreads());
+  for(size_t x = 0; x != m.cols();)
+  {
+    size_t e = (x < dense? min(x + step, dense): x + 1);
+    while(e != m.cols() && x >= dense && m.segmentOf(e) == m.segmentOf(x)) ++e;
+    job.tasks.push_back(cell_job::task());
+    job.tasks.back().lo = x;
+    job.tasks.back().hi = e;
+    x = e;
+  }
+
+  // the transformed cells are written along with the destination
+  dst.filters.assign(job.tasks.size(), cell_filter(opts.strip, opts.numbers));
+  for(size_t t = 0; t != job.tasks.size(); ++t)
+    job.tasks[t].filter = &dst.filters[t];
+  parallelRun(job, job.tasks.size());
+
+  // inputs having each row
+  dst.inputs = n;
+  if(opts.common)
+  {
+    dst.hits.assign(m.rows(), 0);
+    dst.last.assign(m.rows(), 0);
+    for(size_t y = 0; y != first.t->rows(); ++y)
+      dst.hits[y] = dst.last[y] = 1;
+    for(size_t i = 1; i != n; ++i)
+    {
+      foreach_ro(vector<size_t>, it, inputs[i].rowMap)
+      {
+	if(dst.last[*it] == i + 1) continue;
+	dst.last[*it] = i + 1;
+	++dst.hits[*it];
+      }
+    }
+  }
+
+  // report as if merged one input at a time
+  vector<merge_conflict> conflicts;
+  foreach_ro(vector<cell_job::task>, it, job.tasks)
+    conflicts.insert(conflicts.end(), it->conflicts.begin(), it->conflicts.end());
+  sort(conflicts.begin(), conflicts.end());
+  vector<merge_conflict>::const_iterator c = conflicts.begin();
+  for(size_t i = 0; i != n; ++i)
+  {
+    merge_input& in = inputs[i];
+    cerr << in.log;
+    if(verb > 0 && i) cerr << "merging " << in.file << "...\n";
+    for(; c != conflicts.end() && c->input == i; ++c)
+    {
+      string error = conflictError(in.cell(0, c->x), buildKey(in.kc, input_row(in, c->y)));
+      if(!opts.keep_going && !opts.ref)
+	throw runtime_error(sprintf2("%s: %s", in.file, error.c_str()));
+      cerr << error << '\n';
+    }
+  }
+}
+
+
+// compare two keys cell by cell, in byte order
+int
+compareKeys(const fix_string* a, const fix_string* b, size_t width)
+{
+  for(size_t i = 0; i != width; ++i)
+  {
+    size_t n = min(a[i].size(), b[i].size());
+    int r = (n? memcmp(a[i].data(), b[i].data(), n): 0);
+    if(r) return r;
+    if(a[i].size() != b[i].size())
+      return (a[i].size() < b[i].size()? -1: 1);
+  }
+  return 0;
+}
+
+
+// read the next row, applying the cell transformations in place
+bool
+nextRow(fix_row_reader& in, vector<fix_string>& row, cell_filter& filter)
+{
+  filter.clear();
+  if(!in.next(row)) return false;
+  foreach(vector<fix_string>, it, row)
+    *it = filter(*it);
+  return true;
+}
+
+
+// An input of the streaming merge, positioned on its current row
+struct sorted_input
+{
+  const char* file;
+  size_t index;			// position on the command line
+  int fd;
+  fix_row_reader* in;
+  cell_filter filter;
+  vector<fix_string> row;
+  vector<fix_string> key;
+  key_col kc;
+  vector<size_t> dstCol;	// output column of each input column
+  bool eof;
+
+  sorted_input(const char* file, size_t index, const char sep,
+      const merge_opts& opts)
+  : file(file), index(index), fd(openInput(file)), in(NULL),
+    filter(opts.strip, opts.numbers), eof(false)
+  {
+    in = new fix_row_reader(fd, file, sep);
+  }
+
+  ~sorted_input()
+  {
+    delete in;
+    if(fd != STDIN_FILENO) close(fd);
+  }
+
+  void
+  next()
+  {
+    eof = !nextRow(*in, row, filter);
+    if(!eof) keyCells(key, kc, row);
+  }
+
+private:
+  sorted_input(const sorted_input&);
+  sorted_input& operator=(const sorted_input&);
+};
+
+
+// the inputs of the streaming merge, owned
+struct sorted_inputs: public vector<sorted_input*>
+{
+  ~sorted_inputs()
+  {
+    foreach(vector<sorted_input*>, it, *this)
+      delete *it;
+  }
+};
+
+
+// heap order of the inputs: smallest key first, then command-line order
+struct sorted_after
+{
+  size_t width;
+
+  sorted_after(size_t width)
+  : width(width)
+  {}
+
+  bool
+  operator()(const sorted_input* a, const sorted_input* b) const
+  {
+    int r = compareKeys(&a->key[0], &b->key[0], width);
+    return (r? r > 0: a->index > b->index);
+  }
+};
+
+
+static bool
+sortedIndex(const sorted_input* a, const sorted_input* b)
+{
+  return a->index < b->index;
+}
+
+
+// Merge the current row of 'in' into the output row 'dst', recording the
+// input each cell comes from in 'owner'.
+static void
+mergeSortedRow(vector<fix_string>& dst, vector<const sorted_input*>& owner,
+    const sorted_input& in, const vector<string>& labels, string& log,
+    const merge_opts& opts)
+{
+  for(size_t x = 0; x != in.row.size(); ++x)
+  {
+    const fix_string& cell = in.row[x];
+    if(!cell.size()) continue;
+
+    const size_t c = in.dstCol[x];
+    fix_string& dstCell = dst[c];
+    if(!dstCell.size())
+    {
+      dstCell = cell;
+      owner[c] = &in;
+    }
+    else if(cell != dstCell)
+    {
+      try
+      {
+	conflict(log, labels[c], buildKey(in.kc, in.row), dstCell, cell, opts);
+      }
+      catch(const runtime_error& e)
+      { throw runtime_error(sprintf2("%s: %s", in.file, e.what())); }
+      if(dstCell.data() == cell.data()) owner[c] = &in;
+      cerr << log;
+      log.clear();
+    }
+  }
+}
+
+
+// copy the cells of 'dst' coming from 'in', before moving it to the next row
+static void
+pinSortedRow(vector<fix_string>& dst, vector<const sorted_input*>& owner,
+    vector<string>& pinned, const sorted_input& in)
+{
+  for(size_t c = 0; c != dst.size(); ++c)
+  {
+    if(owner[c] != &in) continue;
+    pinned[c].assign(dst[c].data(), dst[c].size());
+    dst[c] = fix_string(pinned[c].data(), pinned[c].size());
+    owner[c] = NULL;
+  }
+}
+
+
+template<class T>
+static void
+writeSortedRow(fix_writer& out, const vector<T>& row, const char sep)
+{
+  for(size_t x = 0; x != row.size(); ++x)
+  {
+    if(x) out << sep;
+    out.put(row[x].data(), row[x].size());
+  }
+  out << '\n';
+}
+
+
+// Move 'in' to its next row, checking the order of the keys. Returns 0 when
+// moving past 'key', 1 for a duplicated key which can be merged (-k), and -1
+// for a duplicated key otherwise.
+static int
+advanceSorted(sorted_input& in, const vector<fix_string>& key,
+    const merge_opts& opts)
+{
+  in.next();
+  if(in.eof) return 0;
+  int r = compareKeys(&in.key[0], &key[0], key.size());
+  if(r < 0)
+  {
+    throw runtime_error(sprintf2("%s: error: not sorted by key at \"%s\"",
+	    in.file, escape(buildKey(in.kc, in.row)).c_str()));
+  }
+  if(r) return 0;
+  cerr << in.file << ": duplicated key \"" << escape(buildKey(in.kc, in.row)) << "\"\n";
+  return (opts.keep_going? 1: -1);
+}
+
+
+// Perform the full join of inputs sorted by key in a single pass, keeping
+// only the current row of each input in memory. Rows are written in key
+// order as soon as all the inputs moved past their key. As in the in-memory
+// merge, duplicated keys (with -k) of the first input are written as separate
+// rows, while those of the other inputs are merged into the first row.
+bool
+mergeSorted(fix_writer& out, char* files[], const vector<string>& keys,
+    const char sep, const merge_opts& opts, int verb)
+{
+  // read all headers to build the output columns
+  sorted_inputs inputs;
+  vector<string> labels;
+  col_map dstCm;
+  for(; *files; ++files)
+  {
+    if(verb > 0) cerr << "opening " << *files << "...\n";
+    inputs.reserve(inputs.size() + 1);
+    inputs.push_back(new sorted_input(*files, inputs.size(), sep, opts));
+    sorted_input& in = *inputs.back();
+    if(!nextRow(*in.in, in.row, in.filter))
+    {
+      cerr << in.file << ": file is empty\n";
+      return false;
+    }
+
+    col_map cm;
+    foreach_ro(vector<fix_string>, it, in.row)
+    {
+      const string cname = *it;
+      if(!cm.insert(make_pair(cname, in.dstCol.size())).second)
+      {
+	cerr << in.file << ": duplicated column \"" << cname << "\"\n";
+	return false;
+      }
+      col_map::iterator dIt = dstCm.find(cname);
+      if(dIt == dstCm.end())
+      {
+	dIt = dstCm.insert(make_pair(cname, labels.size())).first;
+	labels.push_back(cname);
+      }
+      in.dstCol.push_back(dIt->second);
+    }
+
+    foreach_ro(vector<string>, keyIt, keys)
+    {
+      col_map::const_iterator ci = cm.find(*keyIt);
+      if(ci == cm.end())
+      {
+	cerr << in.file << ": cannot find key column \"" << *keyIt << "\"\n";
+	return false;
+      }
+      in.kc.push_back(ci->second);
+    }
+  }
+
+  // header
+  writeSortedRow(out, labels, sep);
+
+  // inputs by current key
+  stats_phase phase("stream");
+  const size_t width = keys.size();
+  const sorted_after after(width);
+  vector<sorted_input*> heap;
+  foreach(vector<sorted_input*>, it, inputs)
+  {
+    (*it)->next();
+    if(!(*it)->eof) heap.push_back(*it);
+  }
+  std::make_heap(heap.begin(), heap.end(), after);
+
+  vector<sorted_input*> match;
+  vector<fix_string> row;
+  vector<const sorted_input*> owner(labels.size());
+  vector<string> pinned(labels.size());
+  vector<vector<string> > dups;
+  vector<string> last(width);
+  vector<fix_string> lastKey(width, fix_string(NULL, 0));
+  string log;
+  while(heap.size())
+  {
+    // keep a copy of the smallest key
+    sorted_input* first = heap.front();
+    for(size_t i = 0; i != width; ++i)
+    {
+      last[i].assign(first->key[i].data(), first->key[i].size());
+      lastKey[i] = fix_string(last[i].data(), last[i].size());
+    }
+
+    // all the inputs sharing the key, in command-line order
+    match.clear();
+    while(heap.size() && !compareKeys(&heap.front()->key[0], &lastKey[0], width))
+    {
+      std::pop_heap(heap.begin(), heap.end(), after);
+      match.push_back(heap.back());
+      heap.pop_back();
+    }
+    sort(match.begin(), match.end(), sortedIndex);
+
+    // merge their rows, moving past the key
+    row.assign(labels.size(), fix_string(NULL, 0));
+    size_t nDups = 0;
+    bool written = false;
+    if(!opts.keep_going)
+    {
+      // duplicates are fatal: write before moving on, without copies
+      foreach_ro(vector<sorted_input*>, it, match)
+	mergeSortedRow(row, owner, **it, labels, log, opts);
+      if(!opts.common || match.size() == inputs.size())
+	writeSortedRow(out, row, sep);
+      written = true;
+    }
+    foreach_ro(vector<sorted_input*>, it, match)
+    {
+      sorted_input& in = **it;
+      if(!written) mergeSortedRow(row, owner, in, labels, log, opts);
+      for(;;)
+      {
+	if(!written) pinSortedRow(row, owner, pinned, in);
+	int r = advanceSorted(in, lastKey, opts);
+	if(r < 0) return false;
+	if(!r) break;
+
+	if(in.index)
+	  mergeSortedRow(row, owner, in, labels, log, opts);
+	else
+	{
+	  // a separate row
+	  if(dups.size() == nDups) dups.push_back(vector<string>(labels.size()));
+	  vector<string>& dst = dups[nDups++];
+	  foreach(vector<string>, c, dst) c->clear();
+	  for(size_t x = 0; x != in.row.size(); ++x)
+	    dst[in.dstCol[x]].assign(in.row[x].data(), in.row[x].size());
+	}
+      }
+
+      if(!in.eof)
+      {
+	heap.push_back(&in);
+	std::push_heap(heap.begin(), heap.end(), after);
+      }
+    }
+
+    if(!written && (!opts.common || match.size() == inputs.size()))
+      writeSortedRow(out, row, sep);
+    if(!opts.common || inputs.size() == 1)
+    {
+      for(size_t i = 0; i != nDups; ++i)
+	writeSortedRow(out, dups[i], sep);
+    }
+  }
 
+  return true;
+}
 
-/*
- * Types and constants
- */
 
-typedef map<string, size_t> col_map;
-typedef map<string, size_t> key_map;
-typedef vector<size_t> key_col;
+// A partition of the out-of-core merge: a temporary file holding the rows of
+// every input whose key hashes to the partition, each input preceded by its
+// header.
+struct spill_part
+{
+  int fd;
+  fix_writer* out;
+  uint64_t pos;
+  vector<uint64_t> off;		// start of each input, plus the end
+  vector<uint64_t> rows;	// rows of each input, header included
+  uint64_t div;			// hash divisor of the partition level
+  bool last;			// cannot be split any further
+};
 
 
-/*
- * Implementation
- */
+// Open the partitions of one level, sharing 'budget' bytes of output buffers
+void
+spillOpen(vector<spill_part>& parts, uint64_t div, size_t budget)
+{
+  size_t size = min(max(budget / parts.size(), spillBufferMin), spillBufferMax);
+  foreach(vector<spill_part>, it, parts)
+  {
+    it->fd = tempFile();
+    it->out = new fix_writer(it->fd, "temporary file", false, size);
+    it->pos = 0;
+    it->div = div;
+    it->last = false;
+  }
+}
+
 
 void
-help(char* argv[])
+spillClose(vector<spill_part>& parts)
 {
-  cerr << argv[0] << ": bad parameters:\n"
-       << "Usage: " << argv[0] << " [-h] key file1 file2 [file3 ...]\n"
-       << "Perform a full join on 'key' of two or more CSV files, performing a\n"
-       << "comparison of common columns. 'key' can be a comma-separated list of\n"
-       << "column names to form unique indexes. CSV files are TAB separated,\n"
-       << "containing column labels on the first row. You can change the column\n"
-       << "separator by setting the TBLSEP environment variable.\n"
-       << "\n"
-       << "  -v:	increase verbosity\n"
-       << "  -k:	keep going on duplicate rows\n"
-       << "  -h:	help summary\n";
+  foreach(vector<spill_part>, it, parts)
+  {
+    it->off.push_back(it->pos);
+    it->out->close();
+    delete it->out;
+    it->out = NULL;
+  }
 }
 
 
-string
-buildKey(const key_col& kc, const vector<fix_string>& row)
+void
+spillRow(spill_part& part, const vector<fix_string>& row, const char sep)
 {
-  key_col::const_iterator it = kc.begin();
-  string buf(row[*it]);
-  for(++it; it != kc.end(); ++it)
+  foreach_ro(vector<fix_string>, it, row)
   {
-    buf += '\0';
-    buf += row[*it];
+    if(it != row.begin()) *part.out << sep;
+    part.out->put(*it);
+    part.pos += it->size() + 1;
   }
-  return buf;
+  *part.out << '\n';
+  ++part.rows.back();
 }
 
 
-string
-unescape(const string& str, const char c = ',')
+// start the rows of the next input with its header
+void
+spillHeader(vector<spill_part>& parts, const vector<fix_string>& row,
+    const char sep)
 {
-  string buf;
-  bool esc = false;
-  foreach_ro(string, p, str)
+  foreach(vector<spill_part>, it, parts)
   {
-    if(*p == '\\' && !esc)
+    it->off.push_back(it->pos);
+    it->rows.push_back(0);
+    spillRow(*it, row, sep);
+  }
+}
+
+
+// Partition of a row at the level of 'parts'. The low bits of the hash are
+// used by the key maps of each partition, each level uses the next digits of
+// the high bits.
+spill_part&
+spillTarget(vector<spill_part>& parts, vector<fix_string>& key,
+    const key_col& kc, const vector<fix_string>& row)
+{
+  uint64_t h = key_map::hash(keyCells(key, kc, row), kc.size());
+  return parts[(h >> 32) / parts[0].div % parts.size()];
+}
+
+
+// Split all the inputs into partitions by key, reading each input once. The
+// cell transformations are applied here. Header errors are reported here.
+bool
+partitionInputs(vector<spill_part>& parts, vector<key_col>& kcs,
+    char* files[], const vector<string>& keys, const char sep,
+    const merge_opts& opts, int verb, size_t budget)
+{
+  stats_phase phase("partition");
+  spillOpen(parts, 1, budget);
+
+  cell_filter filter(opts.strip, opts.numbers);
+  vector<fix_string> row;
+  vector<fix_string> key;
+  for(; *files; ++files)
+  {
+    const char* file = *files;
+    if(verb > 0) cerr << "partitioning " << file << "...\n";
+    int fd = openInput(file);
+    fix_row_reader in(fd, file, sep);
+    if(!nextRow(in, row, filter))
     {
-      esc = true;
-      continue;
+      cerr << file << ": file is empty\n";
+      return false;
     }
 
-    if(*p == c && !esc)
-      buf += '\0';
-    else
-      buf += *p;
+    col_map cm;
+    for(size_t i = 0; i != row.size(); ++i)
+    {
+      const string cname = row[i];
+      if(!cm.insert(make_pair(cname, i)).second)
+      {
+	cerr << file << ": duplicated column \"" << cname << "\"\n";
+	return false;
+      }
+    }
 
-    esc = false;
+    key_col kc;
+    foreach_ro(vector<string>, keyIt, keys)
+    {
+      col_map::const_iterator ci = cm.find(*keyIt);
+      if(ci == cm.end())
+      {
+	cerr << file << ": cannot find key column \"" << *keyIt << "\"\n";
+	return false;
+      }
+      kc.push_back(ci->second);
+    }
+    kcs.push_back(kc);
+
+    spillHeader(parts, row, sep);
+    while(nextRow(in, row, filter))
+      spillRow(spillTarget(parts, key, kc, row), row, sep);
+    if(fd != STDIN_FILENO) close(fd);
   }
-  return buf;
+
+  spillClose(parts);
+  return true;
 }
 
 
-string
-escape(const string& str, const char c = ',')
+// Split a partition by the next digits of the key hash, reading back each
+// input separately.
+void
+splitPart(vector<spill_part>& sub, spill_part& part,
+    const vector<key_col>& kcs, const char sep, size_t budget)
 {
-  string buf;
-  foreach_ro(string, it, str)
+  spillOpen(sub, part.div * sub.size(), budget);
+  vector<fix_string> row;
+  vector<fix_string> key;
+  for(size_t i = 0; i != kcs.size(); ++i)
   {
-    if(*it == '\0')
-      buf += c;
-    else if(*it != c)
-      buf += *it;
-    else
-    {
-      buf += '\\';
-      buf += c;
-    }
+    if(lseek(part.fd, part.off[i], SEEK_SET) < 0)
+      throw runtime_error("temporary file: error: cannot read file!");
+    fix_row_reader in(part.fd, "temporary file", sep);
+    in.next(row);
+    spillHeader(sub, row, sep);
+    for(uint64_t y = 1; y != part.rows[i] && in.next(row); ++y)
+      spillRow(spillTarget(sub, key, kcs[i], row), row, sep);
   }
-  return buf;
+  spillClose(sub);
+  close(part.fd);
 }
 
 
+// Split partition 'p' in place while larger than 'limit' bytes, until its
+// first part fits or cannot be split further (a single key, or no hash digits
+// left). The following parts are split when they come next.
 void
-mergeCharMatrix(fix_string_matrix& dst, col_map& dstCm, key_map& dstKm, const key_col& dstKc,
-		const fix_string_matrix& add, const col_map& addCm, key_map& addKm, const key_col& addKc,
-		bool keep_going=false)
+fitPart(vector<spill_part>& parts, size_t p, const vector<key_col>& kcs,
+    const char sep, int verb, uint64_t limit, size_t budget)
 {
-  // preallocate all columns on dst
-  vector<size_t> addDstCm;
+  for(;;)
+  {
+    spill_part& part = parts[p];
+    uint64_t size = part.off.back();
+    size_t n = min<uint64_t>((size + limit - 1) / limit, spillPartsMax);
+    if(part.last || n < 2 || part.div * n > (1ULL << 32))
+      return;
 
-  foreach_ro(vector<fix_string>, it, add.front())
+    stats_phase phase("split");
+    if(verb > 0) cerr << "splitting partition " << p + 1 << "...\n";
+    vector<spill_part> sub(n);
+    splitPart(sub, part, kcs, sep, budget);
+    foreach(vector<spill_part>, it, sub)
+      it->last = (it->rows == part.rows);
+    parts.erase(parts.begin() + p);
+    parts.insert(parts.begin() + p, sub.begin(), sub.end());
+  }
+}
+
+
+// Merge each partition in memory, writing the results to temporary files.
+// Diagnostics are collected for each partition.
+struct part_job: public parallel_job
+{
+  vector<spill_part>& parts;
+  char** files;
+  const vector<string>& keys;
+  const char sep;
+  merge_opts opts;
+  const int verb;
+  size_t first;
+  vector<string> logs;
+  vector<char> failed;
+  vector<int> results;
+
+  part_job(vector<spill_part>& parts, char* files[], const vector<string>& keys,
+      const char sep, const merge_opts& opts, int verb)
+  : parts(parts), files(files), keys(keys), sep(sep), opts(opts),
+    verb(verb), first(0)
   {
-    string cname = *it;
-    col_map::iterator dIt = dstCm.find(cname);
-    if(dIt != dstCm.end())
-      addDstCm.push_back(dIt->second);
-    else
+    // already transformed while partitioning
+    this->opts.strip = this->opts.numbers = false;
+  }
+
+  // merge the partitions [first, last) using up to 'threads' threads
+  void
+  run(size_t first, size_t last, unsigned threads)
+  {
+    this->first = first;
+    logs.resize(parts.size());
+    failed.resize(parts.size(), 0);
+    results.resize(parts.size(), -1);
+    parallelRun(*this, last - first, threads);
+  }
+
+  bool
+  merge(size_t p);
+
+  void
+  operator()(size_t i)
+  {
+    size_t p = first + i;
+    try { failed[p] = !merge(p); }
+    catch(const runtime_error& e)
     {
-      // allocate a new (empty) column
-      size_t ki = dst.front().size();
-      addDstCm.push_back(ki);
-      dstCm.insert(make_pair(cname, ki));
-      dst.front().push_back(*it);
-      for(fix_string_matrix::iterator dIt = dst.begin() + 1; dIt != dst.end(); ++dIt)
-	dIt->push_back(fix_string(NULL, 0));
+      logs[p] += e.what();
+      logs[p] += '\n';
+      failed[p] = true;
     }
   }
+};
+
+
+bool
+part_job::merge(size_t p)
+{
+  spill_part& part = parts[p];
+  string& log = logs[p];
+  if(verb > 0) log += sprintf2("merging partition %lu...\n", p + 1);
+
+  size_t len;
+  const char* addr = loadInput(part.fd, "temporary file", &len);
+  merge_state dst;
+  for(size_t i = 0; files[i]; ++i)
+  {
+    merge_input in;
+    in.file = files[i];
+    fix_table* t = parseFixTable(addr + part.off[i], part.off[i + 1] - part.off[i],
+	in.file, sep, 1, &in.log);
+    bool ok = indexInput(in, t, keys, opts);
+    auto_ptr<fix_table> tmp(in.t);
+    if(ok) mergeInput(dst, in, opts);
+    log += in.log;
+    if(!ok) return false;
+  }
+
+  // the header is written by the first partition only
+  stats_phase phase("output");
+  results[p] = tempFile();
+  fix_writer out(results[p], "temporary file");
+  writeMerged(out, dst, opts, sep, !p, 1);
+  out.close();
+
+  unloadInput(addr, len);
+  close(part.fd);
+  return true;
+}
+
+
+// A partition result sorted by key, read back one row at a time
+struct ordered_part
+{
+  int fd;
+  fix_row_reader in;
+  vector<fix_string> row;
+  vector<key_cell> key;
+
+  ordered_part(int fd, const char sep, size_t size)
+  : fd(fd), in(fd, "temporary file", sep, size)
+  {
+    if(lseek(fd, 0, SEEK_SET) < 0)
+      throw runtime_error("temporary file: error: cannot read file!");
+  }
+
+  ~ordered_part()
+  { close(fd); }
+
+private:
+  ordered_part(const ordered_part&);
+  ordered_part& operator=(const ordered_part&);
+};
+
+
+// the partition results, owned
+struct ordered_parts: public vector<ordered_part*>
+{
+  ~ordered_parts()
+  {
+    foreach(vector<ordered_part*>, it, *this)
+      delete *it;
+  }
+};
+
+
+// heap order of the partitions, by key of their current row
+struct part_greater
+{
+  const ordered_parts& parts;
+  const size_t width;
+  const key_order order;
+
+  part_greater(const ordered_parts& parts, size_t width, key_order order)
+  : parts(parts), width(width), order(order)
+  {}
+
+  bool
+  operator()(size_t a, size_t b) const
+  {
+    int r = compareOrder(&parts[a]->key[0], &parts[b]->key[0], width, order);
+    return (r? r > 0: a > b);
+  }
+};
 
-  // iterate on add rows
-  dst.reserve(dst.size() + add.size());
 
-  for(fix_string_matrix::const_iterator it = add.begin() + 1; it != add.end(); ++it)
+// Merge the results of the partitions, each sorted by key, sharing 'budget'
+// bytes of input buffers. Rows with the same key can only come from the same
+// partition, so the result is the same as sorting the whole merge at once.
+void
+mergeOrdered(fix_writer& out, const vector<int>& results,
+    const vector<string>& keys, const char sep, key_order order, size_t budget)
+{
+  size_t size = min(max(budget / results.size(), spillBufferMin), spillBufferMax);
+  ordered_parts parts;
+  for(size_t p = 0; p != results.size(); ++p)
+    parts.push_back(new ordered_part(results[p], sep, size));
+
+  // the header comes first, from the first partition
+  parts[0]->in.next(parts[0]->row);
+  writeSortedRow(out, parts[0]->row, sep);
+  col_map cm;
+  for(size_t i = 0; i != parts[0]->row.size(); ++i)
+    cm.insert(make_pair(string(parts[0]->row[i]), i));
+  key_col kc;
+  foreach_ro(vector<string>, it, keys)
+    kc.push_back(cm.find(*it)->second);
+
+  part_greater greater(parts, kc.size(), order);
+  vector<size_t> heap;
+  for(size_t p = 0; p != parts.size(); ++p)
+  {
+    ordered_part& part = *parts[p];
+    part.key.resize(kc.size());
+    if(!part.in.next(part.row)) continue;
+    for(size_t i = 0; i != kc.size(); ++i)
+      prepareKey(part.key[i], part.row[kc[i]], order);
+    heap.push_back(p);
+  }
+  std::make_heap(heap.begin(), heap.end(), greater);
+  while(heap.size())
   {
-    // key lookup
-    string key = buildKey(addKc, *it);
-    key_map::iterator dstKIt = dstKm.find(key);
-    if(dstKIt == dstKm.end())
+    std::pop_heap(heap.begin(), heap.end(), greater);
+    ordered_part& part = *parts[heap.back()];
+    writeSortedRow(out, part.row, sep);
+    if(!part.in.next(part.row))
     {
-      // new row
-      dstKIt = dstKm.insert(make_pair(key, dst.size())).first;
-      dst.push_back(vector<fix_string>(dst.front().size(), fix_string(NULL, 0)));
+      heap.pop_back();
+      continue;
     }
+    for(size_t i = 0; i != kc.size(); ++i)
+      prepareKey(part.key[i], part.row[kc[i]], order);
+    std::push_heap(heap.begin(), heap.end(), greater);
+  }
+}
 
-    // merge row
-    vector<fix_string>& dstRow = dst[dstKIt->second];
-    for(size_t addCol = 0; addCol != it->size(); ++addCol)
+
+// Merge the inputs out-of-core within about 'budget' bytes of memory:
+// partition all the inputs by key, merge the partitions independently and
+// concatenate the results. Rows come out grouped by partition, unless sorted.
+bool
+mergeSpill(fix_writer& out, char* files[], const vector<string>& keys,
+    const char sep, const merge_opts& opts, int verb, size_t budget)
+{
+  // merge fewer partitions at once rather than below a useful size, so that
+  // the partitions merged concurrently fit in the budget
+  size_t threads = min<size_t>(tblThreads(), max<size_t>(1, budget / spillMergeMin));
+  uint64_t limit = max<uint64_t>(1, budget / threads / spillOverhead);
+
+  // size the partitions from the inputs; those which were underestimated
+  // (such as the standard input) are split again afterwards
+  uint64_t total = 0;
+  for(char** f = files; *f; ++f)
+  {
+    struct stat st;
+    if(strcmp(*f, "-") && !stat(*f, &st) && S_ISREG(st.st_mode))
+      total += st.st_size;
+    else
+      total += budget;
+  }
+  size_t n = min<uint64_t>(max<uint64_t>(1, (total + limit - 1) / limit), spillPartsMax);
+
+  // output buffers take at most half of the budget while partitioning
+  vector<spill_part> parts(n);
+  vector<key_col> kcs;
+  if(!partitionInputs(parts, kcs, files, keys, sep, opts, verb, budget / 2))
+    return false;
+
+  // merge the partitions in order, a few at once, splitting them as needed.
+  // Unless sorted, the results are written as soon as they are ready.
+  part_job job(parts, files, keys, sep, opts, verb);
+  for(size_t p = 0; p != parts.size();)
+  {
+    size_t last = p;
+    for(; last != parts.size() && last - p != threads; ++last)
+      fitPart(parts, last, kcs, sep, verb, limit, budget / 2);
+    job.run(p, last, threads);
+
+    for(; p != last; ++p)
     {
-      if(!(*it)[addCol].size()) continue;
+      cerr << job.logs[p];
+      if(job.failed[p]) return false;
+      if(opts.order != order_none) continue;
 
-      size_t dstCol = addDstCm[addCol];
-      if(!dstRow[dstCol].size())
-	dstRow[dstCol] = (*it)[addCol];
-      else
-      {
-	if((*it)[addCol] != dstRow[dstCol])
-	{
-	  string cname = add.front()[addCol];
-	  string error = sprintf2("conflicting contents for column \"%s\", key \"%s\"",
-				  cname.c_str(), escape(key).c_str());
-	  if(keep_going)
-	    cerr << error << std::endl;
-	  else
-	    throw runtime_error(error.c_str());
-	}
-      }
+      stats_phase phase("concatenate");
+      size_t len;
+      const char* addr = loadInput(job.results[p], "temporary file", &len);
+      out.put(addr, len);
+      unloadInput(addr, len);
+      close(job.results[p]);
     }
   }
+
+  if(opts.order != order_none)
+  {
+    stats_phase phase("merge sorted");
+    mergeOrdered(out, job.results, keys, sep, opts.order, budget / 2);
+  }
+  return true;
 }
 
 
@@ -181,8 +2323,15 @@ main(int argc, char* argv[]) try
 {
   int arg;
   int verb = 0;
-  bool keep_going = false;
-  while((arg = getopt(argc, argv, "vhk")) != -1)
+  bool stats = false;
+  unsigned jobs = 0;
+  bool sorted = false;
+  size_t budget = 0;
+  merge_opts opts;
+  opts.keep_going = opts.common = opts.strip = opts.numbers = false;
+  opts.ref = 0;
+  opts.order = order_none;
+  while((arg = getopt(argc, argv, "vhkj:sm:c12itno:S")) != -1)
     switch(arg)
     {
     case 'v':
@@ -190,7 +2339,71 @@ main(int argc, char* argv[]) try
       break;
 
     case 'k':
-      keep_going = true;
+      opts.keep_going = true;
+      break;
+
+    case 'j':
+      jobs = strtoul(optarg, NULL, 10);
+      if(!jobs)
+      {
+	cerr << argv[0] << ": invalid number of jobs \"" << optarg << "\"\n";
+	return EXIT_FAILURE;
+      }
+      break;
+
+    case 's':
+      sorted = true;
+      break;
+
+    case 'm':
+      budget = strtoul(optarg, NULL, 10);
+      if(!budget)
+      {
+	cerr << argv[0] << ": invalid memory budget \"" << optarg << "\"\n";
+	return EXIT_FAILURE;
+      }
+      break;
+
+    case 'c':
+      opts.common = true;
+      break;
+
+    case '1':
+      opts.ref = 1;
+      break;
+
+    case '2':
+      opts.ref = 2;
+      break;
+
+    case 'i':
+      // empty cells are never compared
+      break;
+
+    case 't':
+      opts.strip = true;
+      break;
+
+    case 'n':
+      opts.numbers = true;
+      break;
+
+    case 'o':
+      if(!strcmp(optarg, "bytes"))
+	opts.order = order_bytes;
+      else if(!strcmp(optarg, "natural"))
+	opts.order = order_natural;
+      else if(!strcmp(optarg, "numeric"))
+	opts.order = order_numeric;
+      else
+      {
+	cerr << argv[0] << ": invalid key order \"" << optarg << "\"\n";
+	return EXIT_FAILURE;
+      }
+      break;
+
+    case 'S':
+      stats = true;
       break;
 
     case 'h':
@@ -225,99 +2438,68 @@ main(int argc, char* argv[]) try
     return EXIT_FAILURE;
   }
 
+  statsInit("tblmerge2", stats);
+  if(sorted && opts.order > order_bytes)
+  {
+    // sorted inputs are merged in byte order
+    cerr << argv[0] << ": -s only supports \"-o bytes\"\n";
+    return EXIT_FAILURE;
+  }
+  if(sorted)
+  {
+    // streaming merge
+    fix_writer out(STDOUT_FILENO, "stdout", tblThreads() > 1);
+    if(!mergeSorted(out, argv + optind, keys, sep, opts, verb))
+      return EXIT_FAILURE;
+    out.close();
+    return EXIT_SUCCESS;
+  }
+  if(budget)
+  {
+    // out-of-core merge
+    fix_writer out(STDOUT_FILENO, "stdout", tblThreads() > 1);
+    if(!mergeSpill(out, argv + optind, keys, sep, opts, verb, budget << 20))
+      return EXIT_FAILURE;
+    out.close();
+    return EXIT_SUCCESS;
+  }
+
   // loading stage
+  if(!jobs) jobs = tblThreads();
+  vector<merge_input> inputs(argc - 1);
+  for(size_t i = 0; i != inputs.size(); ++i)
+    inputs[i].file = argv[optind + i];
+
   // NOTE: the (mapped) memory is never freed after the merge, due to pointers
   //       to the mmap-ed region being used for the actual storage. This
   //       results in a very compact memory layout.
-  fix_string_matrix* m = NULL;
-  col_map cm;
-  key_map km;
-  key_col kc;
-  do
+  load_job job(inputs, keys, sep, opts, verb);
+  size_t n = 0;
+  for(; job.first != inputs.size() && n == job.first; job.first += job.n)
   {
-    const char* addr;
-    const char* file(argv[optind++]);
-
-    if(verb > 0) cerr << "loading " << file << "...\n";
-    fix_string_matrix* tmp(mapFixStringMatrix(&addr, file, sep));
-    if(!tmp->size() || !tmp->front().size())
-    {
-      cerr << file << ": file is empty\n";
-      return EXIT_FAILURE;
-    }
-
-    // build the column map
-    col_map ctmp;
-    for(size_t i = 0; i != tmp->front().size(); ++i)
-    {
-      const string cname = tmp->front()[i];
-      if(!ctmp.insert(make_pair(cname, i)).second)
-      {
-	cerr << file << ": duplicated column \"" << cname << "\"\n";
-	return EXIT_FAILURE;
-      }
-    }
-
-    key_col kcTmp;
-    foreach_ro(vector<string>, keyIt, keys)
-    {
-      col_map::const_iterator ci = ctmp.find(*keyIt);
-      if(ci == ctmp.end())
-      {
-	cerr << file << ": cannot find key column \"" << *keyIt << "\"\n";
-	if(!keep_going) return EXIT_FAILURE;
-      }
-      kcTmp.push_back(ci->second);
-    }
-
-    // build the key map
-    key_map ktmp;
-    for(size_t i = 1; i != tmp->size(); ++i)
-    {
-      const string key = buildKey(kcTmp, (*tmp)[i]);
-      if(!ktmp.insert(make_pair(key, i)).second)
-      {
-	cerr << file << ": duplicated key \"" << escape(key) << "\"\n";
-	if(!keep_going) return EXIT_FAILURE;
-      }
-    }
-
-    if(m)
-    {
-      // table merge on the working copy
-      if(verb > 0) cerr << "merging " << file << "...\n";
-      try { mergeCharMatrix(*m, cm, km, kc, *tmp, ctmp, ktmp, kcTmp, keep_going); }
-      catch(const runtime_error& e)
-      {	throw runtime_error(sprintf2("%s: %s", file, e.what())); }
-    }
-    else
-    {
-      // setup the destination table
-      m = tmp;
-      cm.swap(ctmp);
-      km.swap(ktmp);
-      kc.swap(kcTmp);
-    }
+    // load and index the next batch of inputs concurrently
+    job.n = min<size_t>(jobs, inputs.size() - job.first);
+    job.threads = max<unsigned>(1, tblThreads() / job.n);
+    parallelRun(job, job.n, jobs);
+    while(n != job.first + job.n && !inputs[n].failed) ++n;
   }
-  while(argv[optind]);
-  if(!m)
+
+  // merge the inputs preceding the first failure, if any
+  merge_state dst;
+  if(n) mergeTree(dst, inputs, n, opts, verb);
+  foreach(vector<merge_input>, it, inputs)
+    delete it->t;
+  if(n != inputs.size())
   {
-    cerr << argv[0] << ": not enough files loaded\n";
+    cerr << inputs[n].log;
     return EXIT_FAILURE;
   }
 
   // output
-  foreach_ro(fix_string_matrix, it, *m)
-  {
-    vector<fix_string>::const_iterator it2 = it->begin();
-    if(it2->size()) cout << *it2;
-    for(++it2; it2 != it->end(); ++it2)
-    {
-      cout << sep;
-      if(it2->size()) cout << *it2;
-    }
-    cout << '\n';
-  }
+  stats_phase phase("output");
+  fix_writer out(STDOUT_FILENO, "stdout", tblThreads() > 1);
+  writeMerged(out, dst, opts, sep);
+  out.close();
 }
 catch(runtime_error& e)
 {
@@ -10,11 +10,48 @@
 // local headers
 #include "shared.hh"
 
+// system headers
+#include <algorithm>
+using std::min;
+
+#include <memory>
+using std::auto_ptr;
+
 // c headers
 #include <stdlib.h>
 #include <unistd.h>
 
 
+/*
+ * Types and constants
+ */
+
+// approximate amount of output rendered at once by all the threads
+const size_t bandBytes = 1 << 26;
+
+// row ranges rendered concurrently for each thread
+const size_t jobsPerThread = 4;
+
+// input read by each tile, to stay within the L2 cache
+const size_t tileBytes = 1 << 18;
+
+// rows of a tile when each row spans whole pages, so that the pages of the
+// cells and of their index stay within the reach of the TLB
+const size_t tilePages = 32;
+const size_t pageBytes = 1 << 12;
+
+// memory budget (MB) when transposing pipes
+const size_t defaultBudget = 256;
+
+// out-of-core transposition: spilled row blocks and the columns offsets of
+// each one, also kept in a temporary file
+struct spill_file
+{
+  int fd;
+  auto_ptr<fix_writer> out;
+};
+
+
 /*
  * Implementation
  */
@@ -23,25 +60,342 @@ void
 help(char* argv[])
 {
   cerr << argv[0] << ": bad parameters:\n"
-       << "Usage: " << argv[0] << " [-h] file\n"
+       << "Usage: " << argv[0] << " [-h] [-m MB] file|-\n"
        << "Transpose the contents of a CSV file. CSV files are TAB separated by default.\n"
        << "You can change the column separator by setting the TBLSEP environment variable.\n"
        << "\n"
+       << "  -m MB:	transpose out-of-core, using about MB megabytes of memory\n"
+       << "  -S:	print statistics at exit (see TBLSTATS)\n"
        << "  -h:	help summary\n";
 }
 
 
+// transposed fragment of a range of input rows: the cells of each column of
+// the band joined by the separator, stored back to back
+struct transp_frag
+{
+  vector<char> buf;
+  vector<size_t> pos;	// start of each column, plus the end
+};
+
+
+// Render a band of output rows (input columns) split by ranges of input rows,
+// each range into its own fragment. Ranges are walked in tiles of rows x
+// columns fitting the cache, reading all the columns of a tile before moving
+// to the next rows.
+struct transp_job: public parallel_job
+{
+  const fix_table& m;
+  const char sep;
+  size_t x0, x1;
+  const size_t rowsPerJob;
+  const size_t tileRows;
+  const size_t tileCols;
+  vector<transp_frag>& frags;
+
+  transp_job(const fix_table& m, const char sep, size_t rowsPerJob,
+      size_t tileRows, size_t tileCols, vector<transp_frag>& frags)
+  : m(m), sep(sep), x0(0), x1(0), rowsPerJob(rowsPerJob),
+    tileRows(tileRows), tileCols(tileCols), frags(frags)
+  {}
+
+  void
+  operator()(size_t i)
+  {
+    size_t y0 = i * rowsPerJob;
+    size_t y1 = min(y0 + rowsPerJob, m.rows());
+    transp_frag& f = frags[i];
+
+    // size the columns row by row, following the index
+    vector<size_t>& pos = f.pos;
+    pos.assign(x1 - x0 + 1, 0);
+    for(size_t y = y0; y != y1; ++y)
+      for(size_t x = x0; x != x1; ++x)
+	pos[x - x0 + 1] += m.cell(y, x).size() + 1;
+    for(size_t x = 1; x != pos.size(); ++x)
+      pos[x] += pos[x - 1] - 1;
+    f.buf.resize(pos.back());
+
+    vector<size_t> cur(pos.begin(), pos.end() - 1);
+    for(size_t ty = y0; ty < y1; ty += tileRows)
+    {
+      size_t ty1 = min(ty + tileRows, y1);
+      for(size_t tx = x0; tx < x1; tx += tileCols)
+      {
+	size_t tx1 = min(tx + tileCols, x1);
+	for(size_t x = tx; x != tx1; ++x)
+	{
+	  char* p = &f.buf[0] + cur[x - x0];
+	  for(size_t y = ty; y != ty1; ++y)
+	  {
+	    if(y != y0) *p++ = sep;
+	    fix_string cell = m.cell(y, x);
+	    memcpy(p, cell.data(), cell.size());
+	    p += cell.size();
+	  }
+	  cur[x - x0] = p - &f.buf[0];
+	}
+      }
+    }
+  }
+};
+
+
+void
+transposeMapped(fix_writer& out, int fd, const char* file, const char sep)
+{
+  const char* addr;
+  auto_ptr<fix_table> t(mapFixTable(&addr, fd, file, sep));
+  const fix_table& m = *t;
+  if(!m.rows()) return;
+
+  // size the bands and the tiles after the average column and cell
+  size_t len = m.cell(m.rows() - 1, m.cols() - 1).data() - m.data() + 1;
+  size_t colBytes = len / m.cols() + 1;
+  size_t cellBytes = colBytes / m.rows() + 1;
+  size_t band = min(m.cols(), bandBytes / colBytes + 1);
+  size_t tileCols = min(band, tileBytes / (tilePages * cellBytes) + 1);
+  size_t tileRows = tileBytes / (tileCols * cellBytes) + 1;
+  if(len / m.rows() >= pageBytes)
+    tileRows = min(tileRows, tilePages);
+
+  // split the rows among the threads
+  size_t jobs = min(m.rows(), tblThreads() * jobsPerThread);
+  size_t rowsPerJob = (m.rows() + jobs - 1) / jobs;
+  jobs = (m.rows() + rowsPerJob - 1) / rowsPerJob;
+
+  // render each band in parallel, joining the fragments in order
+  stats_phase phase("transpose");
+  vector<transp_frag> frags(jobs);
+  transp_job job(m, sep, rowsPerJob, tileRows, tileCols, frags);
+  for(; job.x0 < m.cols(); job.x0 = job.x1)
+  {
+    job.x1 = min(job.x0 + band, m.cols());
+    parallelRun(job, jobs);
+    for(size_t x = 0; x != job.x1 - job.x0; ++x)
+    {
+      for(size_t i = 0; i != jobs; ++i)
+      {
+	const transp_frag& f = frags[i];
+	if(i) out << sep;
+	out.put(&f.buf[0] + f.pos[x], f.pos[x + 1] - f.pos[x]);
+      }
+      out << '\n';
+    }
+  }
+}
+
+
+static void
+spillOpen(spill_file& f)
+{
+  f.fd = tempFile();
+  f.out.reset(new fix_writer(f.fd, "temporary file"));
+}
+
+
+// write the transposed fragments of a row block to the spill file, recording
+// where each column starts in the index file, and release them
+void
+spillBlock(spill_file& data, spill_file& index, uint64_t& pos,
+    vector<string>& frag)
+{
+  foreach(vector<string>, it, frag)
+  {
+    index.out->put(reinterpret_cast<const char*>(&pos), sizeof(pos));
+    data.out->put(it->data(), it->size());
+    pos += it->size();
+    string().swap(*it);
+  }
+  index.out->put(reinterpret_cast<const char*>(&pos), sizeof(pos));
+}
+
+
+// Transpose blocks of rows fitting half of the budget in memory, spilling the
+// transposed fragments to a temporary file. The output is then assembled in
+// windows of columns whose offsets (for all the blocks) fit a quarter of the
+// budget, and within these in bands of columns fitting half of it, reading
+// the fragments of each block back in one go. Columns larger than that are
+// copied through the buffer piecewise.
+void
+transposeSpill(fix_writer& out, int fd, const char* file, const char sep,
+    size_t budget)
+{
+  stats_phase phase("spill");
+  fix_row_reader in(fd, file, sep);
+  vector<fix_string> row;
+  vector<string> frag;
+  size_t fragBytes = 0;
+  size_t blockRows = 0;
+
+  spill_file data, index;
+  uint64_t pos = 0;
+  size_t blocks = 0;
+
+  while(in.next(row))
+  {
+    if(!frag.size())
+    {
+      frag.resize(row.size());
+      fragBytes = frag.size() * sizeof(string);
+    }
+    for(size_t x = 0; x != row.size(); ++x)
+    {
+      // account for the memory actually allocated
+      string& f = frag[x];
+      size_t cap = f.capacity();
+      if(blockRows) f += sep;
+      f.append(row[x].data(), row[x].size());
+      fragBytes += f.capacity() - cap;
+    }
+    ++blockRows;
+
+    if(fragBytes >= budget / 2)
+    {
+      if(!data.out.get())
+      {
+	spillOpen(data);
+	spillOpen(index);
+      }
+      spillBlock(data, index, pos, frag);
+      ++blocks;
+      fragBytes = frag.size() * sizeof(string);
+      blockRows = 0;
+    }
+  }
+
+  if(!data.out.get())
+  {
+    // everything fit in memory
+    foreach(vector<string>, it, frag)
+    {
+      out.put(it->data(), it->size());
+      out << '\n';
+    }
+    return;
+  }
+  if(blockRows)
+  {
+    spillBlock(data, index, pos, frag);
+    ++blocks;
+  }
+  data.out->close();
+  index.out->close();
+  const size_t cols = frag.size();
+  vector<string>().swap(frag);
+  phase.end();
+
+  // reassemble in windows and bands of columns
+  stats_phase assemble("assemble");
+  const size_t bufBytes = budget / 2;
+  size_t window = budget / 4 / (blocks * sizeof(uint64_t));
+  if(window > 1) --window;
+  else window = 1;
+  vector<uint64_t> off;
+  vector<char> buf;
+  vector<size_t> bufPos(blocks);
+
+  for(size_t w0 = 0, w1; w0 != cols; w0 = w1)
+  {
+    // load the offsets of the window: off[k * n + x - w0] for block k
+    w1 = min(w0 + window, cols);
+    const size_t n = w1 - w0 + 1;
+    off.resize(blocks * n);
+    for(size_t k = 0; k != blocks; ++k)
+    {
+      readAt(index.fd, "temporary file", reinterpret_cast<char*>(&off[k * n]),
+	  n * sizeof(uint64_t), (k * (cols + 1) + w0) * sizeof(uint64_t));
+    }
+
+    for(size_t x0 = w0, x1; x0 != w1; x0 = x1)
+    {
+      size_t bytes = 0;
+      for(x1 = x0; x1 != w1; ++x1)
+      {
+	size_t colBytes = 0;
+	for(size_t k = 0; k != blocks; ++k)
+	  colBytes += off[k * n + x1 + 1 - w0] - off[k * n + x1 - w0];
+	if(bytes + colBytes > bufBytes) break;
+	bytes += colBytes;
+      }
+
+      if(x1 == x0)
+      {
+	// a single column exceeding the buffer
+	buf.resize(bufBytes);
+	for(size_t k = 0; k != blocks; ++k)
+	{
+	  if(k) out << sep;
+	  uint64_t p = off[k * n + x0 - w0];
+	  const uint64_t e = off[k * n + x0 + 1 - w0];
+	  for(size_t len; p != e; p += len)
+	  {
+	    len = min<uint64_t>(bufBytes, e - p);
+	    readAt(data.fd, "temporary file", &buf[0], len, p);
+	    out.put(&buf[0], len);
+	  }
+	}
+	out << '\n';
+	x1 = x0 + 1;
+	continue;
+      }
+
+      buf.resize(bytes);
+      for(size_t k = 0, p = 0; k != blocks; ++k)
+      {
+	const uint64_t b = off[k * n + x0 - w0];
+	size_t len = off[k * n + x1 - w0] - b;
+	if(len) readAt(data.fd, "temporary file", &buf[p], len, b);
+	bufPos[k] = p;
+	p += len;
+      }
+
+      for(size_t x = x0; x != x1; ++x)
+      {
+	for(size_t k = 0; k != blocks; ++k)
+	{
+	  if(k) out << sep;
+	  const uint64_t* o = &off[k * n - w0];
+	  out.put(&buf[bufPos[k] + o[x] - o[x0]], o[x + 1] - o[x]);
+	}
+	out << '\n';
+      }
+    }
+  }
+
+  data.out.reset();
+  index.out.reset();
+  close(data.fd);
+  close(index.fd);
+}
+
+
 int
 main(int argc, char* argv[]) try
 {
   int arg;
-  while((arg = getopt(argc, argv, "h")) != -1)
+  size_t budget = 0;
+  bool stats = false;
+  while((arg = getopt(argc, argv, "hm:S")) != -1)
     switch(arg)
     {
     case 'h':
       help(argv);
       return EXIT_SUCCESS;
 
+    case 'm':
+      budget = strtoul(optarg, NULL, 10);
+      if(!budget)
+      {
+	cerr << argv[0] << ": invalid memory budget \"" << optarg << "\"\n";
+	return EXIT_FAILURE;
+      }
+      break;
+
+    case 'S':
+      stats = true;
+      break;
+
     default:
       return EXIT_FAILURE;
     }
@@ -62,17 +416,19 @@ main(int argc, char* argv[]) try
     sep = *envSep;
 
   // open the file
-  const char* addr;
-  fix_string_matrix& m = *mapFixStringMatrix(&addr, file, sep);
+  statsInit("tbltransp2", stats);
+  int fd = openInput(file);
+  if(!budget && !isMappable(fd))
+    budget = defaultBudget;
 
   // start writing back
-  for(size_t x = 0; x != m.front().size(); ++x)
-  {
-    cout << m[0][x];
-    for(size_t y = 1; y != m.size(); ++y)
-      cout << sep << m[y][x];
-    cout << '\n';
-  }
+  fix_writer out(STDOUT_FILENO, "stdout", tblThreads() > 1);
+  if(!budget)
+    transposeMapped(out, fd, file, sep);
+  else
+    transposeSpill(out, fd, file, sep, budget << 20);
+  stats_phase phase("flush");
+  out.close();
 }
 catch(runtime_error& e)
 {
@@ -0,0 +1,570 @@
+/*
+ * xlsx: streaming XLSX (Office Open XML) writer - implementation
+ * Copyright(c) 2010 EURAC, Institute of Genetic Medicine
+ */
+
+/*
+ * Headers
+ */
+
+// local headers
+#include "xlsx.hh"
+
+// system headers
+#include <algorithm>
+using std::min;
+
+// c headers
+#include <ctype.h>
+#include <strings.h>
+#include <time.h>
+#include <zlib.h>
+
+
+/*
+ * Constants
+ */
+
+// compression level: the sheet XML is very redundant, so that the fastest
+// level costs little in size but halves the deflate time
+static const int deflateLevel = Z_BEST_SPEED;
+
+// shared strings escaped and compressed by a single job
+static const size_t sstChunkStrings = 1 << 16;
+
+// largest value of the 32-bit zip fields (larger ones need zip64 records)
+static const uint64_t zipMax32 = 0xFFFFFFFFULL;
+
+// longest sheet name accepted by Excel
+static const size_t sheetNameMax = 31;
+
+static const char xmlDecl[] =
+  "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"yes\"?>\n";
+
+static const char nsMain[] =
+  "http://schemas.openxmlformats.org/spreadsheetml/2006/main";
+
+static const char nsRel[] =
+  "http://schemas.openxmlformats.org/officeDocument/2006/relationships";
+
+static const char nsPkgRel[] =
+  "http://schemas.openxmlformats.org/package/2006/relationships";
+
+static const char ctMain[] =
+  "application/vnd.openxmlformats-officedocument.spreadsheetml";
+
+static const char stylesXml[] =
+  "<numFmts count=\"1\"><numFmt numFmtId=\"164\" formatCode=\"0.000000\"/></numFmts>"
+  "<fonts count=\"2\">"
+  "<font><sz val=\"11\"/><name val=\"Calibri\"/><family val=\"2\"/></font>"
+  "<font><b/><sz val=\"11\"/><name val=\"Calibri\"/><family val=\"2\"/></font>"
+  "</fonts>"
+  "<fills count=\"2\"><fill><patternFill patternType=\"none\"/></fill>"
+  "<fill><patternFill patternType=\"gray125\"/></fill></fills>"
+  "<borders count=\"1\"><border><left/><right/><top/><bottom/><diagonal/></border></borders>"
+  "<cellStyleXfs count=\"1\"><xf numFmtId=\"0\" fontId=\"0\" fillId=\"0\" borderId=\"0\"/></cellStyleXfs>"
+  "<cellXfs count=\"3\">"
+  "<xf numFmtId=\"0\" fontId=\"0\" fillId=\"0\" borderId=\"0\" xfId=\"0\"/>"
+  "<xf numFmtId=\"0\" fontId=\"1\" fillId=\"0\" borderId=\"0\" xfId=\"0\" applyFont=\"1\"/>"
+  "<xf numFmtId=\"164\" fontId=\"0\" fillId=\"0\" borderId=\"0\" xfId=\"0\" applyNumberFormat=\"1\"/>"
+  "</cellXfs>"
+  "<cellStyles count=\"1\"><cellStyle name=\"Normal\" xfId=\"0\" builtinId=\"0\"/></cellStyles>";
+
+
+/*
+ * Deflated chunks
+ */
+
+void
+deflateChunk(xlsx_chunk& c, const char* p, size_t n, bool last)
+{
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  if(deflateInit2(&z, deflateLevel, Z_DEFLATED, -MAX_WBITS, 8,
+	  Z_DEFAULT_STRATEGY) != Z_OK)
+    throw runtime_error("error: cannot initialize zlib");
+
+  // chunks are small enough for the 32-bit zlib counters; a sync flush
+  // needs a few bytes more than deflateBound()
+  c.data.resize(deflateBound(&z, n) + 16);
+  z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(p));
+  z.avail_in = n;
+  z.next_out = reinterpret_cast<Bytef*>(&c.data[0]);
+  z.avail_out = c.data.size();
+
+  // non-final chunks end on a byte boundary with a sync flush, so that the
+  // following chunk can just be appended
+  int ret = deflate(&z, (last? Z_FINISH: Z_SYNC_FLUSH));
+  bool ok = (last? ret == Z_STREAM_END: ret == Z_OK && !z.avail_in);
+  c.data.resize(z.total_out);
+  deflateEnd(&z);
+  if(!ok) throw runtime_error("error: cannot compress data");
+
+  c.crc = crc32(crc32(0, NULL, 0), reinterpret_cast<const Bytef*>(p), n);
+  c.size = n;
+}
+
+
+
+/*
+ * Writer
+ */
+
+// escape and compress a range of shared strings, leaving room for the header
+// in the first chunk
+struct sst_job: public parallel_job
+{
+  const std::deque<string>& strings;
+  vector<xlsx_chunk>& chunks;
+
+  sst_job(const std::deque<string>& strings, vector<xlsx_chunk>& chunks)
+  : strings(strings), chunks(chunks)
+  {}
+
+  void
+  operator()(size_t i)
+  {
+    size_t end = min(strings.size(), (i + 1) * sstChunkStrings);
+    string buf;
+    for(size_t n = i * sstChunkStrings; n != end; ++n)
+    {
+      const string& s = strings[n];
+      bool preserve = (s.size() && (isspace(static_cast<unsigned char>(s[0]))
+	  || isspace(static_cast<unsigned char>(s[s.size() - 1]))));
+      buf += (preserve? "<si><t xml:space=\"preserve\">": "<si><t>");
+      xlsx_writer::escape(buf, s.data(), s.size());
+      buf += "</t></si>";
+    }
+    deflateChunk(chunks[i + 1], buf);
+  }
+};
+
+
+static void
+put16(string& buf, uint16_t v)
+{
+  buf += static_cast<char>(v & 0xFF);
+  buf += static_cast<char>(v >> 8);
+}
+
+
+static void
+put32(string& buf, uint32_t v)
+{
+  put16(buf, v & 0xFFFF);
+  put16(buf, v >> 16);
+}
+
+
+static void
+put64(string& buf, uint64_t v)
+{
+  put32(buf, v & 0xFFFFFFFF);
+  put32(buf, v >> 32);
+}
+
+
+xlsx_writer::xlsx_writer(int fd, const char* file)
+: fd(fd), file(file), pos(0), stringRefs(0)
+{
+  // DOS timestamp of all the entries
+  time_t now = time(NULL);
+  struct tm t;
+  localtime_r(&now, &t);
+  if(t.tm_year < 80)
+  {
+    dosTime = 0;
+    dosDate = (1 << 5) | 1;
+  }
+  else
+  {
+    dosTime = (t.tm_hour << 11) | (t.tm_min << 5) | (t.tm_sec / 2);
+    dosDate = ((t.tm_year - 80) << 9) | ((t.tm_mon + 1) << 5) | t.tm_mday;
+  }
+}
+
+
+static uint64_t
+stringHash(const string& s)
+{
+  // FNV-1a
+  uint64_t h = 0xCBF29CE484222325ULL;
+  for(string::const_iterator it = s.begin(); it != s.end(); ++it)
+    h = (h ^ static_cast<unsigned char>(*it)) * 0x100000001B3ULL;
+  return h ^ (h >> 32);
+}
+
+
+void
+xlsx_writer::growStrings()
+{
+  vector<uint32_t> tmp(slots.size()? slots.size() * 2: 1024, 0);
+  slots.swap(tmp);
+  size_t mask = slots.size() - 1;
+  for(size_t e = 0; e != strings.size(); ++e)
+  {
+    size_t i = stringHash(strings[e]) & mask;
+    while(slots[i]) i = (i + 1) & mask;
+    slots[i] = e + 1;
+  }
+}
+
+
+uint32_t
+xlsx_writer::sharedString(const string& s)
+{
+  // keep the load factor below 1/2
+  ++stringRefs;
+  if((strings.size() + 1) * 2 > slots.size()) growStrings();
+
+  size_t mask = slots.size() - 1;
+  for(size_t i = stringHash(s) & mask;; i = (i + 1) & mask)
+  {
+    uint32_t e = slots[i];
+    if(!e)
+    {
+      strings.push_back(s);
+      slots[i] = strings.size();
+      return strings.size() - 1;
+    }
+    if(strings[e - 1] == s)
+      return e - 1;
+  }
+}
+
+
+// length of the valid UTF-8 sequence at p, or 0
+static size_t
+utf8Length(const unsigned char* p, const unsigned char* end)
+{
+  size_t n;
+  unsigned char lo = 0x80, hi = 0xBF;
+  if(*p >= 0xC2 && *p <= 0xDF) n = 2;
+  else if(*p >= 0xE0 && *p <= 0xEF)
+  {
+    n = 3;
+    if(*p == 0xE0) lo = 0xA0;
+    else if(*p == 0xED) hi = 0x9F;
+  }
+  else if(*p >= 0xF0 && *p <= 0xF4)
+  {
+    n = 4;
+    if(*p == 0xF0) lo = 0x90;
+    else if(*p == 0xF4) hi = 0x8F;
+  }
+  else
+    return 0;
+
+  if(static_cast<size_t>(end - p) < n) return 0;
+  if(p[1] < lo || p[1] > hi) return 0;
+  for(size_t i = 2; i < n; ++i)
+    if((p[i] & 0xC0) != 0x80) return 0;
+  return n;
+}
+
+
+void
+xlsx_writer::escape(string& dst, const char* p, size_t n)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  const unsigned char* s = reinterpret_cast<const unsigned char*>(p);
+  const unsigned char* end = s + n;
+  while(s != end)
+  {
+    unsigned char c = *s;
+    if(c >= 0x80)
+    {
+      size_t l = utf8Length(s, end);
+      if(l)
+      {
+	dst.append(reinterpret_cast<const char*>(s), l);
+	s += l;
+      }
+      else
+      {
+	// ISO-8859-1
+	dst += static_cast<char>(0xC0 | (c >> 6));
+	dst += static_cast<char>(0x80 | (c & 0x3F));
+	++s;
+      }
+      continue;
+    }
+
+    switch(c)
+    {
+    case '&': dst += "&amp;"; break;
+    case '<': dst += "&lt;"; break;
+    case '>': dst += "&gt;"; break;
+    case '"': dst += "&quot;"; break;
+    case '\t': case '\n': dst += c; break;
+
+    // XML parsers turn raw carriage returns into newlines
+    case '\r': dst += "_x000D_"; break;
+
+    // keep a literal "_xHHHH_" from being read back as an escape
+    case '_':
+      if(end - s >= 7 && s[1] == 'x' && isxdigit(s[2]) && isxdigit(s[3])
+	  && isxdigit(s[4]) && isxdigit(s[5]) && s[6] == '_')
+	dst += "_x005F_";
+      else
+	dst += c;
+      break;
+
+    default:
+      if(c >= 0x20) dst += c;
+      else
+      {
+	// control characters are not allowed in XML
+	dst += "_x00";
+	dst += hex[c >> 4];
+	dst += hex[c & 0xF];
+	dst += '_';
+      }
+    }
+    ++s;
+  }
+}
+
+
+string
+xlsx_writer::columnName(size_t x)
+{
+  string name;
+  for(++x; x; x = (x - 1) / 26)
+    name.insert(name.begin(), static_cast<char>('A' + (x - 1) % 26));
+  return name;
+}
+
+
+void
+xlsx_writer::addSheet(const string& name, vector<xlsx_chunk>& body)
+{
+  // same restrictions as Excel
+  string sn = name.substr(0, sheetNameMax);
+  for(string::iterator it = sn.begin(); it != sn.end(); ++it)
+    if(strchr("[]:*?/\\", *it)) *it = '_';
+  if(sn.empty()) sn = sprintf2("Sheet%lu", sheets.size() + 1);
+  for(vector<sheet>::const_iterator it = sheets.begin(); it != sheets.end(); ++it)
+  {
+    if(!strcasecmp(it->name.c_str(), sn.c_str()))
+      throw runtime_error(sprintf2("error: duplicate sheet name \"%s\"", sn.c_str()));
+  }
+
+  sheets.push_back(sheet());
+  sheet& s = sheets.back();
+  s.name = sn;
+  s.chunks.resize(body.size() + 2);
+  deflateChunk(s.chunks.front(), sprintf2("%s<worksheet xmlns=\"%s\" xmlns:r=\"%s\"><sheetData>",
+	  xmlDecl, nsMain, nsRel));
+  for(size_t i = 0; i != body.size(); ++i)
+  {
+    xlsx_chunk& c = s.chunks[i + 1];
+    c.data.swap(body[i].data);
+    c.crc = body[i].crc;
+    c.size = body[i].size;
+  }
+  deflateChunk(s.chunks.back(), string("</sheetData></worksheet>"), true);
+}
+
+
+void
+xlsx_writer::writeEntry(fix_writer& out, vector<zip_entry>& dir,
+    const char* name, const vector<xlsx_chunk>& chunks, bool mapped)
+{
+  zip_entry e;
+  e.name = name;
+  e.crc = crc32(0, NULL, 0);
+  e.size = e.csize = 0;
+  e.offset = pos;
+  for(vector<xlsx_chunk>::const_iterator it = chunks.begin(); it != chunks.end(); ++it)
+  {
+    e.crc = crc32_combine(e.crc, it->crc, it->size);
+    e.size += it->size;
+    e.csize += it->data.size();
+  }
+  bool zip64 = (e.size >= zipMax32 || e.csize >= zipMax32);
+
+  // local file header
+  string buf;
+  put32(buf, 0x04034B50);
+  put16(buf, (zip64? 45: 20));
+  put16(buf, 0);
+  put16(buf, Z_DEFLATED);
+  put16(buf, dosTime);
+  put16(buf, dosDate);
+  put32(buf, e.crc);
+  put32(buf, (zip64? zipMax32: e.csize));
+  put32(buf, (zip64? zipMax32: e.size));
+  put16(buf, e.name.size());
+  put16(buf, (zip64? 20: 0));
+  buf += e.name;
+  if(zip64)
+  {
+    put16(buf, 0x0001);
+    put16(buf, 16);
+    put64(buf, e.size);
+    put64(buf, e.csize);
+  }
+  out.put(buf.data(), buf.size());
+  pos += buf.size();
+
+  for(vector<xlsx_chunk>::const_iterator it = chunks.begin(); it != chunks.end(); ++it)
+  {
+    if(mapped) out.putMapped(it->data.data(), it->data.size());
+    else out.put(it->data.data(), it->data.size());
+  }
+  pos += e.csize;
+  dir.push_back(e);
+}
+
+
+void
+xlsx_writer::writeEntry(fix_writer& out, vector<zip_entry>& dir,
+    const char* name, const string& data)
+{
+  vector<xlsx_chunk> chunks(1);
+  deflateChunk(chunks[0], data, true);
+  writeEntry(out, dir, name, chunks, false);
+}
+
+
+void
+xlsx_writer::close()
+{
+  // Excel needs at least one sheet
+  if(sheets.empty())
+  {
+    vector<xlsx_chunk> body;
+    addSheet("", body);
+  }
+
+  // package structure
+  string types = sprintf2("%s<Types xmlns=\"http://schemas.openxmlformats.org/package/2006/content-types\">"
+      "<Default Extension=\"rels\" ContentType=\"application/vnd.openxmlformats-package.relationships+xml\"/>"
+      "<Default Extension=\"xml\" ContentType=\"application/xml\"/>"
+      "<Override PartName=\"/xl/workbook.xml\" ContentType=\"%s.sheet.main+xml\"/>"
+      "<Override PartName=\"/xl/styles.xml\" ContentType=\"%s.styles+xml\"/>"
+      "<Override PartName=\"/xl/sharedStrings.xml\" ContentType=\"%s.sharedStrings+xml\"/>",
+      xmlDecl, ctMain, ctMain, ctMain);
+  string book = sprintf2("%s<workbook xmlns=\"%s\" xmlns:r=\"%s\"><sheets>",
+      xmlDecl, nsMain, nsRel);
+  string bookRels = sprintf2("%s<Relationships xmlns=\"%s\">", xmlDecl, nsPkgRel);
+  for(size_t i = 0; i != sheets.size(); ++i)
+  {
+    types += sprintf2("<Override PartName=\"/xl/worksheets/sheet%lu.xml\""
+	" ContentType=\"%s.worksheet+xml\"/>", i + 1, ctMain);
+    book += "<sheet name=\"";
+    escape(book, sheets[i].name.data(), sheets[i].name.size());
+    book += sprintf2("\" sheetId=\"%lu\" r:id=\"rId%lu\"/>", i + 1, i + 1);
+    bookRels += sprintf2("<Relationship Id=\"rId%lu\" Type=\"%s/worksheet\""
+	" Target=\"worksheets/sheet%lu.xml\"/>", i + 1, nsRel, i + 1);
+  }
+  types += "</Types>";
+  book += "</sheets></workbook>";
+  bookRels += sprintf2("<Relationship Id=\"rId%lu\" Type=\"%s/styles\" Target=\"styles.xml\"/>"
+      "<Relationship Id=\"rId%lu\" Type=\"%s/sharedStrings\" Target=\"sharedStrings.xml\"/>"
+      "</Relationships>", sheets.size() + 1, nsRel, sheets.size() + 2, nsRel);
+  string rels = sprintf2("%s<Relationships xmlns=\"%s\">"
+      "<Relationship Id=\"rId1\" Type=\"%s/officeDocument\" Target=\"xl/workbook.xml\"/>"
+      "</Relationships>", xmlDecl, nsPkgRel, nsRel);
+  string styles = sprintf2("%s<styleSheet xmlns=\"%s\">%s</styleSheet>",
+      xmlDecl, nsMain, stylesXml);
+
+  // shared strings
+  vector<xlsx_chunk> sst((strings.size() + sstChunkStrings - 1) / sstChunkStrings + 2);
+  {
+    stats_phase phase("deflate");
+    sst_job job(strings, sst);
+    parallelRun(job, sst.size() - 2);
+    deflateChunk(sst.front(), sprintf2("%s<sst xmlns=\"%s\" count=\"%lu\" uniqueCount=\"%lu\">",
+	    xmlDecl, nsMain, static_cast<unsigned long>(stringRefs), strings.size()));
+    deflateChunk(sst.back(), string("</sst>"), true);
+  }
+
+  // zip container
+  stats_phase phase("write");
+  fix_writer out(fd, file);
+  vector<zip_entry> dir;
+  pos = 0;
+  writeEntry(out, dir, "[Content_Types].xml", types);
+  writeEntry(out, dir, "_rels/.rels", rels);
+  writeEntry(out, dir, "xl/workbook.xml", book);
+  writeEntry(out, dir, "xl/_rels/workbook.xml.rels", bookRels);
+  writeEntry(out, dir, "xl/styles.xml", styles);
+  for(size_t i = 0; i != sheets.size(); ++i)
+  {
+    string name = sprintf2("xl/worksheets/sheet%lu.xml", i + 1);
+    writeEntry(out, dir, name.c_str(), sheets[i].chunks, true);
+  }
+  writeEntry(out, dir, "xl/sharedStrings.xml", sst, true);
+
+  // central directory
+  string buf;
+  uint64_t cdOffset = pos;
+  for(vector<zip_entry>::const_iterator it = dir.begin(); it != dir.end(); ++it)
+  {
+    string extra;
+    if(it->size >= zipMax32) put64(extra, it->size);
+    if(it->csize >= zipMax32) put64(extra, it->csize);
+    if(it->offset >= zipMax32) put64(extra, it->offset);
+    bool zip64 = !extra.empty();
+
+    put32(buf, 0x02014B50);
+    put16(buf, (zip64? 45: 20));
+    put16(buf, (zip64? 45: 20));
+    put16(buf, 0);
+    put16(buf, Z_DEFLATED);
+    put16(buf, dosTime);
+    put16(buf, dosDate);
+    put32(buf, it->crc);
+    put32(buf, min(it->csize, zipMax32));
+    put32(buf, min(it->size, zipMax32));
+    put16(buf, it->name.size());
+    put16(buf, (zip64? extra.size() + 4: 0));
+    put16(buf, 0);
+    put16(buf, 0);
+    put16(buf, 0);
+    put32(buf, 0);
+    put32(buf, min(it->offset, zipMax32));
+    buf += it->name;
+    if(zip64)
+    {
+      put16(buf, 0x0001);
+      put16(buf, extra.size());
+      buf += extra;
+    }
+  }
+  uint64_t cdSize = buf.size();
+  pos += cdSize;
+
+  if(cdOffset >= zipMax32 || cdSize >= zipMax32)
+  {
+    // zip64 end of central directory record and locator
+    put32(buf, 0x06064B50);
+    put64(buf, 44);
+    put16(buf, 45);
+    put16(buf, 45);
+    put32(buf, 0);
+    put32(buf, 0);
+    put64(buf, dir.size());
+    put64(buf, dir.size());
+    put64(buf, cdSize);
+    put64(buf, cdOffset);
+
+    put32(buf, 0x07064B50);
+    put32(buf, 0);
+    put64(buf, pos);
+    put32(buf, 1);
+  }
+
+  put32(buf, 0x06054B50);
+  put16(buf, 0);
+  put16(buf, 0);
+  put16(buf, dir.size());
+  put16(buf, dir.size());
+  put32(buf, min(cdSize, zipMax32));
+  put32(buf, min(cdOffset, zipMax32));
+  put16(buf, 0);
+  out.put(buf.data(), buf.size());
+  out.close();
+}
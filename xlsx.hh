@@ -0,0 +1,124 @@
+/*
+ * xlsx: streaming XLSX (Office Open XML) writer
+ * Copyright(c) 2010 EURAC, Institute of Genetic Medicine
+ */
+
+#pragma once
+
+/*
+ * Headers
+ */
+
+// local headers
+#include "shared.hh"
+
+// system headers
+#include <deque>
+
+
+/*
+ * Deflated chunks
+ */
+
+// A piece of a compressed part. Chunks are deflated independently (and thus
+// possibly concurrently), but their concatenation is a single deflate stream.
+struct xlsx_chunk
+{
+  string data;		// raw deflate data
+  uint32_t crc;		// CRC-32 of the uncompressed data
+  uint64_t size;	// uncompressed size
+};
+
+// compress 'n' bytes at 'p' into 'c', which is the last chunk of its part
+// when 'last' is set
+void
+deflateChunk(xlsx_chunk& c, const char* p, size_t n, bool last = false);
+
+inline void
+deflateChunk(xlsx_chunk& c, const string& s, bool last = false)
+{ deflateChunk(c, s.data(), s.size(), last); }
+
+
+/*
+ * Writer
+ */
+
+// cell styles defined by the writer
+enum xlsx_style
+{
+  xlsx_plain,
+  xlsx_bold,
+  xlsx_double	// numbers with 6 decimals
+};
+
+
+// Writes a workbook to a file descriptor (which needs not be seekable). The
+// sheets are kept in compressed form until close(); shared strings are
+// deduplicated across all the sheets.
+class xlsx_writer
+{
+  struct sheet
+  {
+    string name;
+    vector<xlsx_chunk> chunks;
+  };
+
+  struct zip_entry
+  {
+    string name;
+    uint32_t crc;
+    uint64_t size;
+    uint64_t csize;
+    uint64_t offset;
+  };
+
+  int fd;
+  const char* file;
+  uint16_t dosTime;
+  uint16_t dosDate;
+  uint64_t pos;		// output offset
+  vector<sheet> sheets;
+
+  // shared strings (open addressing, with the index + 1 of each string)
+  std::deque<string> strings;
+  vector<uint32_t> slots;
+  uint64_t stringRefs;
+
+  void
+  growStrings();
+
+  // write a zip entry made of 'chunks', referencing their data when 'mapped'
+  void
+  writeEntry(fix_writer& out, vector<zip_entry>& dir, const char* name,
+      const vector<xlsx_chunk>& chunks, bool mapped);
+
+  void
+  writeEntry(fix_writer& out, vector<zip_entry>& dir, const char* name,
+      const string& data);
+
+public:
+  xlsx_writer(int fd, const char* file);
+
+  // index of 's' in the shared strings table, adding it when missing
+  uint32_t
+  sharedString(const string& s);
+
+  // Append the XML text of 'n' bytes at 'p' to 'dst', escaping markup and
+  // control characters (including '\r', and the '_' of a literal "_xHHHH_",
+  // as "_xHHHH_"). Bytes which are not valid UTF-8 are taken as ISO-8859-1.
+  static void
+  escape(string& dst, const char* p, size_t n);
+
+  // column name (A, B, ... AA, ...) of column 'x' (starting from 0)
+  static string
+  columnName(size_t x);
+
+  // Add a worksheet named 'name'. The 'body' chunks contain the rows of the
+  // sheetData element, deflated without 'last'. Their data is taken over.
+  void
+  addSheet(const string& name, vector<xlsx_chunk>& body);
+
+  // write the workbook
+  void
+  close();
+};